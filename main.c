@@ -7,9 +7,19 @@
 #include "ctype.h"
 #include "errno.h"
 #include "string.h"
+#include "stdint.h"
 #include "sys/types.h"
 #include "stdarg.h"
 #include "fcntl.h"
+#include "sys/stat.h"
+#include "sys/mman.h"
+#include "pthread.h"
+#include "sched.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include "immintrin.h"
+#define LINE_SCAN_X86 1
+#endif
 
 // Data
 editorConfig E;
@@ -26,1067 +36,4836 @@ editorSyntax HLDB[] = {
      C_HL_extensions,
      C_HL_keywords,
      "//", "/*", "*/",
-     HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS},
+     HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS,
+     NULL},
 };
 #define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))
 
-// Row operations
+// Slab allocator
 
-void editorFreeRow(editorRow *row)
+// Row payloads (piece arrays, render and hl) come in power-of-two size
+// classes carved from large chunks. Freed blocks wait on a per-class list
+// for reuse and go back to the system only all at once, in slabRelease.
+// The highlight worker allocates too, so the lists have their own lock.
+
+int slabClass(size_t need)
 {
-    free(row->chars);
-    free(row->render);
-    free(row->hl);
+    int k = 0;
+    while (((size_t)1 << (k + SLAB_MIN_SHIFT)) < need)
+        k++;
+    return k;
 }
 
-void editorDeleteRow(int at)
+slabChunk *slabNewChunk(size_t cap)
 {
-    if (at < 0 || at >= E.numRows)
-        return;
-    editorFreeRow(&E.rows[at]);
-    memmove(&E.rows[at], &E.rows[at + 1], sizeof(editorRow) * (E.numRows - at - 1));
-    for (int j = at; j < E.numRows - 1; j++)
-        E.rows[j].idx--;
-    E.numRows--;
-    E.dirty++;
+    slabChunk *c = malloc(sizeof(slabChunk) + cap);
+    if (c == NULL)
+        die("malloc");
+    c->used = 0;
+    c->cap = cap;
+    return c;
 }
 
-void editorRowAppendString(editorRow *row, char *s, size_t len)
+void *slabAlloc(size_t need, int *cap)
 {
-    row->chars = realloc(row->chars, row->size + len + 1);
-    memcpy(&row->chars[row->size], s, len);
-    row->size += len;
-    row->chars[row->size] = '\0';
-    editorUpdateRow(row);
-    E.dirty++;
+    int k = slabClass(need ? need : 1);
+    if (k >= SLAB_CLASSES)
+        die("slabAlloc");
+    size_t size = (size_t)1 << (k + SLAB_MIN_SHIFT);
+    slabAllocator *slab = &E.slab;
+
+    pthread_mutex_lock(&slab->lock);
+    void *p = slab->freeList[k];
+    if (p)
+        slab->freeList[k] = *(void **)p;
+    else
+    {
+        slabChunk *c = slab->chunks;
+        if (size > SLAB_CHUNK_SIZE / 4)
+        {
+            // Big blocks get a chunk of their own, kept behind the one
+            // small blocks are carved from.
+            c = slabNewChunk(size);
+            if (slab->chunks)
+            {
+                c->next = slab->chunks->next;
+                slab->chunks->next = c;
+            }
+            else
+            {
+                c->next = NULL;
+                slab->chunks = c;
+            }
+        }
+        else if (c == NULL || c->cap - c->used < size)
+        {
+            c = slabNewChunk(SLAB_CHUNK_SIZE);
+            c->next = slab->chunks;
+            slab->chunks = c;
+        }
+        p = c->data + c->used;
+        c->used += size;
+    }
+    pthread_mutex_unlock(&slab->lock);
+
+    *cap = size;
+    return p;
 }
 
-int editorRowCxToRx(editorRow *row, int cx)
+void slabFree(void *p, int cap)
 {
-    int rx = 0;
-    int j;
-    for (j = 0; j < cx; j++)
+    if (p == NULL)
+        return;
+    int k = slabClass(cap);
+    pthread_mutex_lock(&E.slab.lock);
+    *(void **)p = E.slab.freeList[k];
+    E.slab.freeList[k] = p;
+    pthread_mutex_unlock(&E.slab.lock);
+}
+
+// Frees every row payload at once, touching only the chunks.
+void slabRelease()
+{
+    slabChunk *c = E.slab.chunks;
+    while (c)
     {
-        if (row->chars[j] == '\t')
-            rx += (EDITOR_TAB_STOP - 1) - (rx % EDITOR_TAB_STOP);
-        rx++;
+        slabChunk *next = c->next;
+        free(c);
+        c = next;
     }
-    return rx;
+    E.slab.chunks = NULL;
+    memset(E.slab.freeList, 0, sizeof(E.slab.freeList));
 }
 
-int editorRowRxToCx(editorRow *row, int rx)
+// Text store
+
+const char *textAppend(const char *s, int len)
 {
-    int cur_rx = 0;
-    int cx;
-    for (cx = 0; cx < row->size; cx++)
+    textAddBlock *block = E.text.add;
+    if (block == NULL || block->cap - block->used < len)
     {
-        if (row->chars[cx] == '\t')
-            cur_rx += (EDITOR_TAB_STOP - 1) - (cur_rx % EDITOR_TAB_STOP);
-        cur_rx++;
-        if (cur_rx > rx)
-            return cx;
+        int cap = len > TEXT_ADD_BLOCK_SIZE ? len : TEXT_ADD_BLOCK_SIZE;
+        block = malloc(sizeof(textAddBlock) + cap);
+        if (block == NULL)
+            die("malloc");
+        block->prev = E.text.add;
+        block->used = 0;
+        block->cap = cap;
+        E.text.add = block;
     }
-    return cx;
+    char *p = &block->data[block->used];
+    memcpy(p, s, len);
+    block->used += len;
+    return p;
 }
 
-void editorUpdateRow(editorRow *row)
+void textFree()
 {
-    int tabs = 0;
-    int j;
-    for (j = 0; j < row->size; j++)
-        if (row->chars[j] == '\t')
-            tabs++;
+    while (E.text.add)
+    {
+        textAddBlock *prev = E.text.add->prev;
+        free(E.text.add);
+        E.text.add = prev;
+    }
+    if (E.text.origMapped || E.text.origCopy)
+        munmap(E.text.orig, E.text.origLen);
+    else
+        free(E.text.orig);
+    free(E.text.lines);
+    E.text.lines = NULL;
+    E.text.orig = NULL;
+    E.text.origLen = 0;
+    E.text.origMapped = 0;
+    E.text.origCopy = 0;
+}
 
-    free(row->render);
-    row->render = malloc((row->size + tabs) * (EDITOR_TAB_STOP - 1) + 1);
+// Maps the file read-only; rows are slices of the mapping until edited, so
+// only pages that are actually viewed or saved become resident.
+int textMapFile(int fd, size_t len)
+{
+    if (len == 0)
+        return -1;
+    void *p = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED)
+        return -1;
+    E.text.orig = p;
+    E.text.origLen = len;
+    E.text.origMapped = 1;
+    return 0;
+}
 
-    int idx = 0;
-    for (j = 0; j < row->size; j++)
+void textReadFile(int fd, size_t len)
+{
+    size_t cap = len ? len : 4096;
+    size_t got = 0;
+    E.text.orig = malloc(cap);
+    while (1)
     {
-        if (row->chars[j] == '\t')
-        {
-            row->render[idx++] = ' ';
-            while (idx % EDITOR_TAB_STOP != 0)
-                row->render[idx++] = ' ';
-        }
-        else
+        if (got == cap)
         {
-            row->render[idx++] = row->chars[j];
+            cap *= 2;
+            E.text.orig = realloc(E.text.orig, cap);
         }
+        ssize_t n = read(fd, E.text.orig + got, cap - got);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        got += n;
     }
-    row->render[idx] = '\0';
-    row->rsize = idx;
-    editorUpdateSyntax(row);
+    E.text.origLen = got;
+    E.text.origMapped = 0;
 }
 
-void editorInsertRow(int at, char *s, size_t len)
+// Rewriting the mapped file in place would change (or, once truncated,
+// fault) the bytes unedited rows still point at. Stream the mapping into an
+// unlinked temp file and map that over the same address, so every piece
+// stays valid and the old text stays on disk rather than in memory. Runs on
+// the writer thread: E.lock is only taken to swap the mappings, since the
+// original never changes while it is mapped. Returns 0, or -1 with errno set.
+int textDetachOrig()
 {
-    E.rows = realloc(E.rows, sizeof(editorRow) * (E.numRows + 1));
-    memmove(&E.rows[at + 1], &E.rows[at], sizeof(editorRow) * (E.numRows - at));
-    for (int j = at + 1; j <= E.numRows; j++)
-        E.rows[j].idx++;
-
-    E.rows[at].idx = at;
-
-    E.rows[at].size = len;
-    E.rows[at].chars = malloc(len + 1);
-    memcpy(E.rows[at].chars, s, len);
-    E.rows[at].chars[len] = '\0';
-
-    E.rows[at].rsize = 0;
-    E.rows[at].render = NULL;
-    E.rows[at].hl = NULL;
-    E.rows[at].hlOpenComment = 0;
-    editorUpdateRow(&E.rows[at]);
+    pthread_mutex_lock(&E.lock);
+    int mapped = E.text.origMapped;
+    char *orig = E.text.orig;
+    size_t len = E.text.origLen;
+    pthread_mutex_unlock(&E.lock);
+    if (!mapped)
+        return 0;
 
-    E.numRows++;
-    E.dirty++;
+    const char *dir = getenv("TMPDIR");
+    if (dir == NULL || *dir == '\0')
+        dir = "/tmp";
+    int fd = open(dir, O_TMPFILE | O_RDWR, 0600);
+    if (fd == -1)
+    {
+        size_t tmpLen = strlen(dir) + 24;
+        char *tmp = malloc(tmpLen);
+        if (tmp == NULL)
+            die("malloc");
+        snprintf(tmp, tmpLen, "%s/.editor-orig.XXXXXX", dir);
+        fd = mkstemp(tmp);
+        if (fd != -1)
+            unlink(tmp);
+        free(tmp);
+        if (fd == -1)
+            return -1;
+    }
+    int ok = 1;
+    for (size_t off = 0; ok && off < len; off += EDITOR_SAVE_CHUNK)
+    {
+        struct iovec iov = {orig + off, len - off < EDITOR_SAVE_CHUNK ? len - off : EDITOR_SAVE_CHUNK};
+        ok = editorWriteAll(fd, &iov, 1) != -1;
+    }
+    if (ok)
+    {
+        pthread_mutex_lock(&E.lock);
+        E.hlGen++;
+        ok = mmap(orig, len, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) != MAP_FAILED;
+        if (ok)
+        {
+            E.text.origMapped = 0;
+            E.text.origCopy = 1;
+        }
+        pthread_mutex_unlock(&E.lock);
+    }
+    int err = errno;
+    close(fd);
+    errno = err;
+    return ok ? 0 : -1;
 }
 
-void editorRowInsertChar(editorRow *row, int at, int c)
+void textRowInsertPieces(editorRow *row, int at, const textPiece *pieces, int n)
 {
-    if (at < 0 || at > row->size)
-        at = row->size;
+    if (n == 0)
+        return;
+    // Rows built by editorOpen borrow their single piece from the line index
+    // (pieceCap == 0) and only get an array of their own once it must grow.
+    if (row->numPieces + n > row->pieceCap)
+    {
+        int cap = row->pieceCap ? row->pieceCap * 2 : 4;
+        while (cap < row->numPieces + n)
+            cap *= 2;
+        int bytes;
+        textPiece *grown = slabAlloc(sizeof(textPiece) * cap, &bytes);
+        if (row->numPieces)
+            memcpy(grown, row->pieces, sizeof(textPiece) * row->numPieces);
+        if (row->pieceCap)
+            slabFree(row->pieces, sizeof(textPiece) * row->pieceCap);
+        row->pieces = grown;
+        row->pieceCap = bytes / sizeof(textPiece);
+    }
+    memmove(&row->pieces[at + n], &row->pieces[at], sizeof(textPiece) * (row->numPieces - at));
+    memcpy(&row->pieces[at], pieces, sizeof(textPiece) * n);
+    row->numPieces += n;
+}
 
-    row->chars = realloc(row->chars, row->size + 2);
-    memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
-    row->size++;
-    row->chars[at] = c;
-    editorUpdateRow(row);
+// Gives a row that borrows its piece from the line index an array of its
+// own, so that changing a piece never writes to the shared index.
+void textRowOwnPieces(editorRow *row)
+{
+    if (row->pieceCap || row->numPieces == 0)
+        return;
+    textPiece borrowed = row->pieces[0];
+    row->pieces = NULL;
+    row->numPieces = 0;
+    textRowInsertPieces(row, 0, &borrowed, 1);
 }
 
-void editorInsertChar(int c)
+// Makes sure a piece boundary falls on byte `at` and returns the index of the
+// piece starting there (numPieces when `at` is the end of the row).
+int textRowSplit(editorRow *row, int at)
 {
-    if (E.cy == E.numRows)
-        editorInsertRow(E.numRows, "", 0);
-    editorRowInsertChar(&E.rows[E.cy], E.cx, c);
-    E.cx++;
-    E.dirty++;
+    int off = 0;
+    int i;
+    for (i = 0; i < row->numPieces; i++)
+    {
+        textPiece *p = &row->pieces[i];
+        if (at == off)
+            return i;
+        if (at < off + p->len)
+        {
+            textRowOwnPieces(row);
+            p = &row->pieces[i];
+            textPiece tail = {p->start + (at - off), p->len - (at - off)};
+            p->len = at - off;
+            textRowInsertPieces(row, i + 1, &tail, 1);
+            return i + 1;
+        }
+        off += p->len;
+    }
+    return i;
 }
 
-void editorInsertNewline()
+void textRowInsert(editorRow *row, int at, const char *s, int len)
 {
-    if (E.cx == 0)
+    if (len <= 0)
+        return;
+    int i = textRowSplit(row, at);
+    const char *p = textAppend(s, len);
+    if (i > 0 && row->pieces[i - 1].start + row->pieces[i - 1].len == p)
     {
-        editorInsertRow(E.cy, "", 0);
+        textRowOwnPieces(row);
+        row->pieces[i - 1].len += len;
     }
     else
     {
-        editorRow *row = &E.rows[E.cy];
-        editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
-        row = &E.rows[E.cy];
-        row->size = E.cx;
-        row->chars[row->size] = '\0';
-        editorUpdateRow(row);
+        textPiece piece = {p, len};
+        textRowInsertPieces(row, i, &piece, 1);
     }
-    E.cy++;
-    E.cx = 0;
+    row->size += len;
 }
 
-void editorRowDelChar(editorRow *row, int at)
+void textRowDelete(editorRow *row, int at, int len)
 {
-    if (at < 0 || at >= row->size)
+    if (len <= 0)
         return;
-
-    memmove(&row->chars[at], &row->chars[at + 1], row->size - at - 1);
-    row->size--;
-    editorUpdateRow(row);
-    E.dirty++;
+    int i = textRowSplit(row, at);
+    int j = textRowSplit(row, at + len);
+    memmove(&row->pieces[i], &row->pieces[j], sizeof(textPiece) * (row->numPieces - j));
+    row->numPieces -= j - i;
+    row->size -= len;
+    // A borrowed line emptied this way must not keep pointing at its entry
+    // in the line index, which still spans the deleted bytes.
+    if (row->numPieces == 0 && row->pieceCap == 0)
+        row->pieces = NULL;
 }
 
-void editorDelChar()
+void textRowTruncate(editorRow *row, int at)
 {
-    if (E.cy == E.numRows)
-        return;
-    if (E.cx == 0 && E.cy == 0)
-        return;
-
-    editorRow *row = &E.rows[E.cy];
+    row->numPieces = textRowSplit(row, at);
+    row->size = at;
+}
 
-    if (E.cx > 0)
+void textRowAppendPieces(editorRow *row, const textPiece *pieces, int n)
+{
+    for (int j = 0; j < n; j++)
     {
-        editorRowDelChar(row, E.cx - 1);
-        E.cx--;
+        textPiece *last = row->numPieces ? &row->pieces[row->numPieces - 1] : NULL;
+        if (last && last->start + last->len == pieces[j].start)
+        {
+            textRowOwnPieces(row);
+            row->pieces[row->numPieces - 1].len += pieces[j].len;
+        }
+        else
+            textRowInsertPieces(row, row->numPieces, &pieces[j], 1);
+        row->size += pieces[j].len;
     }
-    else
+}
+
+// Replaces n sorted, non-overlapping ranges of the row with `with`, building
+// the new piece list in one pass over the old one.
+void textRowReplace(editorRow *row, const searchMatch *matches, int n, textPiece with)
+{
+    int bytes;
+    textPiece *out = slabAlloc(sizeof(textPiece) * (row->numPieces + 2 * n + 1), &bytes);
+    int count = 0;
+    int pi = 0, poff = 0, pos = 0, size = 0;
+    for (int k = 0; k <= n; k++)
     {
-        E.cx = E.rows[E.cy - 1].size;
-        editorRowAppendString(&E.rows[E.cy - 1], row->chars, row->size);
-        editorDeleteRow(E.cy);
-        E.cy--;
+        int target = k < n ? matches[k].col : row->size;
+        while (pos < target)
+        {
+            const textPiece *p = &row->pieces[pi];
+            int take = p->len - poff < target - pos ? p->len - poff : target - pos;
+            if (count && out[count - 1].start + out[count - 1].len == p->start + poff)
+                out[count - 1].len += take;
+            else
+            {
+                out[count].start = p->start + poff;
+                out[count++].len = take;
+            }
+            poff += take;
+            pos += take;
+            size += take;
+            if (poff == p->len)
+            {
+                pi++;
+                poff = 0;
+            }
+        }
+        if (k == n)
+            break;
+        if (with.len)
+        {
+            out[count++] = with;
+            size += with.len;
+        }
+        for (int skip = matches[k].len; skip > 0;)
+        {
+            const textPiece *p = &row->pieces[pi];
+            int take = p->len - poff < skip ? p->len - poff : skip;
+            poff += take;
+            pos += take;
+            skip -= take;
+            if (poff == p->len)
+            {
+                pi++;
+                poff = 0;
+            }
+        }
     }
+    if (row->pieceCap)
+        slabFree(row->pieces, sizeof(textPiece) * row->pieceCap);
+    row->pieces = out;
+    row->pieceCap = bytes / sizeof(textPiece);
+    row->numPieces = count;
+    row->size = size;
 }
 
-// file IO operations
+// Copies bytes [at, at + len) of the row to dst.
+void textRowRead(editorRow *row, int at, int len, char *dst)
+{
+    for (int j = 0; j < row->numPieces && len > 0; j++)
+    {
+        const textPiece *p = &row->pieces[j];
+        if (at >= p->len)
+        {
+            at -= p->len;
+            continue;
+        }
+        int n = p->len - at < len ? p->len - at : len;
+        memcpy(dst, p->start + at, n);
+        dst += n;
+        len -= n;
+        at = 0;
+    }
+}
 
-char *editorRowsToString(int *buflen)
+char *textRowCopy(editorRow *row, char *dst)
 {
-    int length = 0;
-    int j;
-    for (j = 0; j < E.numRows; j++)
-        length += E.rows[j].size + 1;
-    *buflen = length;
-    char *buf = malloc(length);
-    char *p = buf;
-    for (j = 0; j < E.numRows; j++)
+    for (int j = 0; j < row->numPieces; j++)
     {
-        memcpy(p, E.rows[j].chars, E.rows[j].size);
-        p += E.rows[j].size;
-        *p = '\n';
-        p++;
+        memcpy(dst, row->pieces[j].start, row->pieces[j].len);
+        dst += row->pieces[j].len;
     }
-    return buf;
+    return dst;
 }
 
-void editorSave()
+// Reports whether the row's text holds s[0..len) starting at byte `at`.
+int textRowMatch(editorRow *row, int at, const char *s, int len)
 {
-    if (E.filename == NULL)
+    if (at + len > row->size)
+        return 0;
+    for (int j = 0; j < row->numPieces && len > 0; j++)
     {
-        E.filename = editorPrompt("Save as: %s", NULL);
-        if (E.filename == NULL)
+        const textPiece *p = &row->pieces[j];
+        if (at >= p->len)
         {
-            editorSetStatusMessage("Save aborted");
-            return;
+            at -= p->len;
+            continue;
         }
-        editorSelectSyntaxHighlight();
+        int n = p->len - at < len ? p->len - at : len;
+        if (memcmp(p->start + at, s, n))
+            return 0;
+        s += n;
+        len -= n;
+        at = 0;
     }
-    int len;
-    char *buf = editorRowsToString(&len);
+    return 1;
+}
 
-    int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
-    if (fd == -1)
+const char *textSearchScalar(const char *hay, size_t n, const char *needle, size_t m)
+{
+    for (size_t i = 0; i + m <= n; i++)
     {
-        editorSetStatusMessage("Error while saving file");
+        const char *hit = memchr(hay + i, needle[0], n - m + 1 - i);
+        if (hit == NULL)
+            return NULL;
+        i = hit - hay;
+        if (hay[i + m - 1] == needle[m - 1] && !memcmp(hit + 1, needle + 1, m - 2))
+            return hit;
     }
-    else
+    return NULL;
+}
+
+#ifdef LINE_SCAN_X86
+// Blocks of candidate positions are filtered on the needle's first and last
+// byte and only survivors are compared in full. A block may read past the
+// end of the haystack, but never into the next page, so it cannot fault;
+// the positions it covers beyond the end are masked off. Only a block that
+// would cross into the next page is finished by the scalar search, so a
+// short row takes a block or two and no byte-by-byte tail.
+__attribute__((no_sanitize_address)) const char *textSearchSSE2(const char *hay, size_t n,
+                                                                 const char *needle, size_t m)
+{
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[m - 1]);
+    size_t positions = n - m + 1;
+    uintptr_t pageEnd = (uintptr_t)(hay + n - 1) | 4095;
+    for (size_t i = 0; i < positions; i += 16)
     {
-        if (ftruncate(fd, len) != -1)
+        if ((uintptr_t)(hay + i + m - 1 + 15) > pageEnd)
+            return textSearchScalar(hay + i, n - i, needle, m);
+        __m128i a = _mm_loadu_si128((const __m128i *)(hay + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(hay + i + m - 1));
+        unsigned int mask = _mm_movemask_epi8(
+            _mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+        if (positions - i < 16)
+            mask &= (1u << (positions - i)) - 1;
+        while (mask)
         {
-            write(fd, buf, len);
-            close(fd);
-            free(buf);
-            editorSetStatusMessage("%d bytes written to disk", len);
-            E.dirty = 0;
-            return;
+            size_t at = i + __builtin_ctz(mask);
+            if (!memcmp(hay + at + 1, needle + 1, m - 2))
+                return hay + at;
+            mask &= mask - 1;
         }
     }
-    free(buf);
-    editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+    return NULL;
 }
 
-void editorOpen(char *fileName)
+__attribute__((target("avx2"), no_sanitize_address)) const char *textSearchAVX2(
+    const char *hay, size_t n, const char *needle, size_t m)
 {
-    free(E.filename);
-    E.filename = strdup(fileName);
-    editorSelectSyntaxHighlight();
+    const __m256i first = _mm256_set1_epi8(needle[0]);
+    const __m256i last = _mm256_set1_epi8(needle[m - 1]);
+    size_t positions = n - m + 1;
+    uintptr_t pageEnd = (uintptr_t)(hay + n - 1) | 4095;
+    for (size_t i = 0; i < positions; i += 32)
+    {
+        if ((uintptr_t)(hay + i + m - 1 + 31) > pageEnd)
+            return textSearchScalar(hay + i, n - i, needle, m);
+        __m256i a = _mm256_loadu_si256((const __m256i *)(hay + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(hay + i + m - 1));
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(
+            _mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+        if (positions - i < 32)
+            mask &= (1u << (positions - i)) - 1;
+        while (mask)
+        {
+            size_t at = i + __builtin_ctz(mask);
+            if (!memcmp(hay + at + 1, needle + 1, m - 2))
+                return hay + at;
+            mask &= mask - 1;
+        }
+    }
+    return NULL;
+}
+#endif
 
-    FILE *fp = fopen(fileName, "r");
-    if (!fp)
-        die("fopen");
+// Returns the first occurrence of needle[0..m) in hay[0..n), or NULL. Neither
+// side needs a terminator and NUL bytes are ordinary text.
+const char *textSearch(const char *hay, size_t n, const char *needle, size_t m)
+{
+    if (m == 0)
+        return hay;
+    if (m > n)
+        return NULL;
+    if (m == 1)
+        return memchr(hay, needle[0], n);
+#ifdef LINE_SCAN_X86
+    if (__builtin_cpu_supports("avx2"))
+        return textSearchAVX2(hay, n, needle, m);
+    return textSearchSSE2(hay, n, needle, m);
+#else
+    return textSearchScalar(hay, n, needle, m);
+#endif
+}
 
-    char *line = NULL;
-    size_t lineCap = 0;
-    ssize_t lineLen;
+// Row operations
 
-    while ((lineLen = getline(&line, &lineCap, fp)) != -1)
+// Makes room for `len` bytes of render and hl, plus render's terminator.
+// Capacity only grows, so re-rendering an edited row rarely allocates, and
+// the contents are kept so a patched row can grow in place.
+void editorRowReserve(editorRow *row, int len)
+{
+    if (len + 1 <= row->renderCap)
+        return;
+    int cap;
+    char *render = slabAlloc(len + 1, &cap);
+    unsigned char *hl = slabAlloc(len + 1, &cap);
+    if (row->rsize)
     {
-        while (lineLen > 0 && (line[lineLen - 1] == '\n' ||
-                               line[lineLen - 1] == '\r'))
-            lineLen--;
-
-        editorInsertRow(E.numRows, line, lineLen);
+        memcpy(render, row->render, row->rsize);
+        memcpy(hl, row->hl, row->rsize);
     }
-    free(line);
-    fclose(fp);
-    E.dirty = 0;
+    slabFree(row->render, row->renderCap);
+    slabFree(row->hl, row->renderCap);
+    row->render = render;
+    row->hl = hl;
+    row->renderCap = cap;
 }
 
-// Append Buffer
+void editorRowReleaseRender(editorRow *row)
+{
+    slabFree(row->render, row->renderCap);
+    slabFree(row->hl, row->renderCap);
+    row->render = NULL;
+    row->hl = NULL;
+    row->renderCap = 0;
+    row->rsize = 0;
+}
 
-void abAppend(aBuf *ab, const char *s, int len)
+void editorFreeRow(editorRow *row)
 {
-    char *new = realloc(ab->b, ab->len + len);
-    if (new == NULL)
-        return;
-    memcpy(&new[ab->len], s, len);
-    ab->b = new;
-    ab->len += len;
+    if (row->pieceCap)
+        slabFree(row->pieces, sizeof(textPiece) * row->pieceCap);
+    editorRowReleaseRender(row);
 }
 
-void abFree(aBuf *ab)
+// Rows live in a gap array: slots [gapStart, gapStart + gapLen) of E.rows
+// are unused, so inserting or deleting rows next to the previous edit only
+// moves the gap instead of every row after it. A row's index follows from
+// its slot.
+editorRow *editorRowAt(int at)
 {
-    free(ab->b);
+    if (at >= E.rowsFilled)
+        lineIndexInitRows(at + EDITOR_FILL_ROWS);
+    return &E.rows[at < E.gapStart ? at : at + E.gapLen];
 }
 
-// Terminal
+int editorRowIndex(const editorRow *row)
+{
+    int slot = row - E.rows;
+    return slot < E.gapStart ? slot : slot - E.gapLen;
+}
 
-void die(const char *s)
+void editorRowsMoveGap(int at)
 {
-    write(STDOUT_FILENO, "\x1b[2J", 4);
-    write(STDOUT_FILENO, "\x1b[H", 3);
-    perror(s);
-    exit(EXIT_FAILURE);
+    if (at < E.gapStart)
+        memmove(&E.rows[at + E.gapLen], &E.rows[at], sizeof(editorRow) * (E.gapStart - at));
+    else if (at > E.gapStart)
+        memmove(&E.rows[E.gapStart], &E.rows[E.gapStart + E.gapLen],
+                sizeof(editorRow) * (at - E.gapStart));
+    E.gapStart = at;
 }
 
-void disableRawMode()
+// The row being typed on keeps its text in a gap buffer, exposed to every
+// reader as the two pieces either side of the gap, so inserting or deleting
+// at the cursor moves no other byte. Leaving the row folds only the span
+// that was edited back into the add buffer; the untouched head and tail
+// keep their old pieces.
+void lineGapPublish()
 {
-    if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) == -1)
-        die("tcsetattr");
+    lineGap *g = &E.edit;
+    editorRow *row = editorRowAt(g->row);
+    int n = 0;
+    if (g->start > 0)
+    {
+        row->pieces[n].start = g->buf;
+        row->pieces[n++].len = g->start;
+    }
+    if (g->end < g->cap)
+    {
+        row->pieces[n].start = g->buf + g->end;
+        row->pieces[n++].len = g->cap - g->end;
+    }
+    row->numPieces = n;
+    row->size = g->start + g->cap - g->end;
 }
 
-void enableRawMode()
+void lineGapMove(int at)
 {
-    if (tcgetattr(STDIN_FILENO, &E.orig_termios) == -1)
-        die("tcgetattr");
+    lineGap *g = &E.edit;
+    if (at < g->start)
+        memmove(g->buf + g->end - (g->start - at), g->buf + at, g->start - at);
+    else if (at > g->start)
+        memmove(g->buf + g->start, g->buf + g->end, at - g->start);
+    g->end += at - g->start;
+    g->start = at;
+}
 
-    atexit(disableRawMode);
+char lineGapByte(int at)
+{
+    lineGap *g = &E.edit;
+    return g->buf[at < g->start ? at : at + g->end - g->start];
+}
 
-    struct termios raw = E.orig_termios;
-    raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
-    raw.c_oflag &= ~(OPOST);
-    raw.c_cflag |= (CS8);
-    raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
-    raw.c_cc[VMIN] = 0;
-    raw.c_cc[VTIME] = 1;
-    if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1)
-        die("tcsetattr");
+void lineGapAddMark(int k, int cx, int rx)
+{
+    lineGap *g = &E.edit;
+    if (g->numMarks == g->markCap)
+    {
+        g->markCap = g->markCap ? g->markCap * 2 : 16;
+        g->marks = realloc(g->marks, sizeof(renderMark) * g->markCap);
+        if (g->marks == NULL)
+            die("realloc");
+    }
+    memmove(&g->marks[k + 1], &g->marks[k], sizeof(renderMark) * (g->numMarks - k));
+    g->marks[k].cx = cx;
+    g->marks[k].rx = rx;
+    g->marks[k].hlState = HL_STATE_UNKNOWN;
+    g->numMarks++;
 }
 
-int editorReadKey()
+// Returns the last mark at or before byte cx; the first mark is always at 0.
+int lineGapFindMark(int cx)
 {
-    int nread;
-    char c;
-    while ((nread = read(STDIN_FILENO, &c, 1)) != 1)
+    lineGap *g = &E.edit;
+    int lo = 0, hi = g->numMarks - 1;
+    while (lo < hi)
     {
-        if (nread == -1 && errno != EAGAIN)
-            die("read");
+        int mid = (lo + hi + 1) / 2;
+        if (g->marks[mid].cx <= cx)
+            lo = mid;
+        else
+            hi = mid - 1;
     }
-    if (c == '\x1b')
+    return lo;
+}
+
+// Places marks along the freshly rendered gap row; the lexer fills in their
+// states.
+void lineGapMarkRow(editorRow *row)
+{
+    E.edit.numMarks = 0;
+    lineGapAddMark(0, 0, 0);
+    int rx = 0;
+    for (int cx = 0; cx < row->size; cx++)
     {
-        char seq[3];
-        if (read(STDIN_FILENO, &seq[0], 1) != 1)
-            return '\x1b';
-        if (read(STDIN_FILENO, &seq[1], 1) != 1)
-            return '\x1b';
-        if (seq[0] == '[')
-        {
-            if (seq[1] >= '0' && seq[1] <= '9')
-            {
-                if (read(STDIN_FILENO, &seq[2], 1) != 1)
-                    return '\x1b';
-                if (seq[2] == '~')
-                {
-                    switch (seq[1])
-                    {
-                    case '5':
-                        return PAGE_UP;
-                    case '6':
-                        return PAGE_DOWN;
-                    case '1':
-                    case '7':
-                        return HOME_KEY;
-                    case '4':
-                    case '8':
-                        return END_KEY;
-                    case '3':
-                        return DELETE_KEY;
-                    }
-                }
-            }
-            else
-            {
-                switch (seq[1])
-                {
-                case 'A':
-                    return ARROW_UP;
-                case 'B':
-                    return ARROW_DOWN;
-                case 'C':
-                    return ARROW_RIGHT;
-                case 'D':
-                    return ARROW_LEFT;
-                case 'H':
-                    return HOME_KEY;
-                case 'F':
-                    return END_KEY;
-                }
-            }
+        if (cx > 0 && cx % EDITOR_RENDER_MARK == 0)
+            lineGapAddMark(E.edit.numMarks, cx, rx);
+        if (lineGapByte(cx) == '\t')
+            rx += (EDITOR_TAB_STOP - 1) - (rx % EDITOR_TAB_STOP);
+        rx++;
+    }
+}
+
+int lineGapCxToRx(int cx)
+{
+    const renderMark *m = &E.edit.marks[lineGapFindMark(cx)];
+    int rx = m->rx;
+    for (int j = m->cx; j < cx; j++)
+    {
+        if (lineGapByte(j) == '\t')
+            rx += (EDITOR_TAB_STOP - 1) - (rx % EDITOR_TAB_STOP);
+        rx++;
+    }
+    return rx;
+}
+
+void lineGapGrow(int need)
+{
+    lineGap *g = &E.edit;
+    if (g->end - g->start >= need)
+        return;
+    int tail = g->cap - g->end;
+    int cap;
+    char *buf = slabAlloc((size_t)(g->start + tail) * 2 + need + EDITOR_LINE_GAP, &cap);
+    memcpy(buf, g->buf, g->start);
+    memcpy(buf + cap - tail, g->buf + g->end, tail);
+    slabFree(g->buf, g->cap);
+    g->buf = buf;
+    g->cap = cap;
+    g->end = cap - tail;
+}
+
+void lineGapOpen(int at)
+{
+    lineGap *g = &E.edit;
+    editorRow *row = editorRowAt(at);
+    g->row = at;
+    g->saved = *row;
+    g->buf = slabAlloc(row->size + EDITOR_LINE_GAP, &g->cap);
+    textRowCopy(row, g->buf);
+    g->start = row->size;
+    g->end = g->cap;
+    g->head = row->size;
+    g->tail = row->size;
+    g->numMarks = 0;
+
+    int bytes;
+    row->pieces = slabAlloc(sizeof(textPiece) * 2, &bytes);
+    row->pieceCap = bytes / sizeof(textPiece);
+    lineGapPublish();
+}
+
+// Returns the gap buffer of `row`, switching it over from the previous row.
+lineGap *lineGapFor(editorRow *row)
+{
+    int at = editorRowIndex(row);
+    if (E.edit.row != at)
+    {
+        lineGapFlush();
+        lineGapOpen(at);
+    }
+    return &E.edit;
+}
+
+// Hands the gap row back to the piece table. Anything that edits rows other
+// than through the gap calls this first.
+void lineGapFlush()
+{
+    lineGap *g = &E.edit;
+    if (g->row < 0)
+        return;
+    editorRow *row = editorRowAt(g->row);
+    int size = row->size;
+    int len = size - g->head - g->tail;
+    if (g->start > g->head && g->start < size - g->tail)
+        lineGapMove(size - g->tail);
+    const char *edited = g->buf + g->head + (g->start <= g->head ? g->end - g->start : 0);
+
+    textRowDelete(&g->saved, g->head, g->saved.size - g->head - g->tail);
+    textRowInsert(&g->saved, g->head, edited, len);
+    slabFree(row->pieces, sizeof(textPiece) * row->pieceCap);
+    row->pieces = g->saved.pieces;
+    row->numPieces = g->saved.numPieces;
+    row->pieceCap = g->saved.pieceCap;
+    row->size = g->saved.size;
+
+    slabFree(g->buf, g->cap);
+    g->buf = NULL;
+    g->cap = 0;
+    g->row = -1;
+    g->numMarks = 0;
+}
+
+void editorDeleteRow(int at)
+{
+    lineGapFlush();
+    if (at < 0 || at >= E.numRows)
+        return;
+    editorFreeRow(editorRowAt(at));
+    editorRowsMoveGap(at);
+    E.gapLen++;
+    E.rowsFilled--;
+    E.rowsShift--;
+    if (at < E.hlValid)
+        E.hlValid = at;
+    E.hlGen++;
+    E.numRows--;
+    E.dirty++;
+}
+
+void editorRowAppendPieces(editorRow *row, const textPiece *pieces, int n)
+{
+    textRowAppendPieces(row, pieces, n);
+    editorUpdateRow(row);
+    E.dirty++;
+}
+
+int editorRowCxToRx(editorRow *row, int cx)
+{
+    if (E.edit.numMarks && row == editorRowAt(E.edit.row))
+        return lineGapCxToRx(cx);
+    int rx = 0;
+    for (int i = 0; i < row->numPieces && cx > 0; i++)
+    {
+        const char *s = row->pieces[i].start;
+        int n = row->pieces[i].len < cx ? row->pieces[i].len : cx;
+        for (int j = 0; j < n; j++)
+        {
+            if (s[j] == '\t')
+                rx += (EDITOR_TAB_STOP - 1) - (rx % EDITOR_TAB_STOP);
+            rx++;
         }
-        else if (seq[0] == 'O')
+        cx -= n;
+    }
+    return rx;
+}
+
+// Edits only mark the row; render and hl are rebuilt when the row is drawn.
+void editorUpdateRow(editorRow *row)
+{
+    row->renderDirty = 1;
+    E.hlGen++;
+    int at = editorRowIndex(row);
+    if (at < E.hlValid)
+        E.hlValid = at;
+}
+
+void editorRenderRow(editorRow *row)
+{
+    int tabs = 0;
+    int i, j;
+    for (i = 0; i < row->numPieces; i++)
+        for (j = 0; j < row->pieces[i].len; j++)
+            if (row->pieces[i].start[j] == '\t')
+                tabs++;
+
+    editorRowReserve(row, row->size + tabs * (EDITOR_TAB_STOP - 1));
+
+    int idx = 0;
+    for (i = 0; i < row->numPieces; i++)
+    {
+        const char *s = row->pieces[i].start;
+        for (j = 0; j < row->pieces[i].len; j++)
         {
-            switch (seq[1])
+            if (s[j] == '\t')
             {
-            case 'H':
-                return HOME_KEY;
-            case 'F':
-                return END_KEY;
+                row->render[idx++] = ' ';
+                while (idx % EDITOR_TAB_STOP != 0)
+                    row->render[idx++] = ' ';
+            }
+            else
+            {
+                row->render[idx++] = s[j];
             }
         }
-        return '\x1b';
-    }
-    else
-    {
-        return c;
     }
+    row->render[idx] = '\0';
+    row->rsize = idx;
 }
 
-int getCursorPosition(int *rows, int *cols)
+// Rebuilds render/hl if the row changed or the lexer state flowing into it
+// did, and reports whether it had to. Without `keep`, a row that was never
+// drawn is only scanned for its outgoing state and its buffers are released.
+int editorRowRefresh(int at, int keep)
 {
-    char buf[32];
-    unsigned int i = 0;
+    editorRow *row = editorRowAt(at);
+    int stateIn = at > 0 ? editorRowAt(at - 1)->hlStateOut : 0;
+    int hadRender = row->render != NULL;
+    if (!row->renderDirty && row->hlStateIn == stateIn && (hadRender || !keep))
+        return 0;
 
-    if (write(STDOUT_FILENO, "\x1b[6n", 4) != 4)
-        return -1;
-    while (i < sizeof(buf) - 1)
+    editorRenderRow(row);
+    row->hlStateIn = stateIn;
+    if (at == E.edit.row)
     {
-        if (read(STDIN_FILENO, &buf[i], 1) != 1)
-            break;
-        if (buf[i] == 'R')
-            break;
-        i++;
+        lineGapMarkRow(row);
+        editorUpdateSyntaxFrom(row, 0, stateIn | HL_STATE_PREV_SEP, E.edit.marks,
+                               E.edit.numMarks, row->rsize);
     }
-    buf[i] = '\0';
-    if (buf[0] != '\x1b' || buf[1] != '[')
-        return -1;
-    if (sscanf(&buf[2], "%d;%d", rows, cols) != 2)
-        return -1;
-    return 0;
+    else
+        editorUpdateSyntax(row);
+    row->renderDirty = 0;
+
+    if (!keep && !hadRender)
+        editorRowReleaseRender(row);
+    return 1;
 }
 
-int getWindowSize(int *rows, int *cols)
+int editorHlCrossesLines()
 {
-    struct winsize ws;
-    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0)
+    return E.syntax && (E.syntax->multilineCommentStart ||
+                        (E.syntax->flags & HL_HIGHLIGHT_STRINGS));
+}
+
+// The state flowing into this row is not known yet and the worker will
+// colour it; until then show its last highlighting, or plain text.
+void editorRowPlain(int at)
+{
+    editorRow *row = editorRowAt(at);
+    if (row->render && !row->renderDirty)
+        return;
+    editorRenderRow(row);
+    memset(row->hl, HL_NORMAL, row->rsize);
+    row->hlStateIn = HL_STATE_UNKNOWN;
+    row->renderDirty = 0;
+    if (at == E.edit.row)
+        E.edit.numMarks = 0;
+}
+
+// Makes render/hl of row `at` current. Lexer state is carried forward from
+// the first row that may be stale, stopping early where a row's incoming
+// state did not change. The walk spends at most E.hlBudget rows per frame;
+// past that the row is drawn from the state last seen above it and
+// editorIdle finishes the walk.
+void editorRowPrepare(int at)
+{
+    if (!editorHlCrossesLines())
+        E.hlValid = at;
+    if (E.hlWorker && at > E.hlValid)
     {
-        if (write(STDOUT_FILENO, "\x1b[999C\x1b[999B", 12) != 12)
-            return -1;
-        return getCursorPosition(rows, cols);
+        editorRowPlain(at);
+        return;
     }
-    else
-    {
-        *cols = ws.ws_col;
-        *rows = ws.ws_row;
+    for (; E.hlValid < at && E.hlBudget > 0; E.hlValid++, E.hlBudget--)
+        editorRowRefresh(E.hlValid, 0);
+    editorRowRefresh(at, 1);
+    if (E.hlValid == at)
+        E.hlValid++;
+}
+
+// Advances the lexer state walk by up to `n` rows and reports whether a row
+// on screen was re-highlighted.
+int editorHighlightStep(int n)
+{
+    int redraw = 0;
+    if (!editorHlCrossesLines())
         return 0;
+    for (; n > 0 && E.hlValid < E.numRows; n--, E.hlValid++)
+    {
+        if (editorRowRefresh(E.hlValid, 0) &&
+            E.hlValid >= E.rowOff && E.hlValid < E.rowOff + E.screenRows)
+            redraw = 1;
     }
+    return redraw;
 }
 
-// Input
-
-char *editorPrompt(char *prompt, void (*callback)(char *, int))
+// Highlights rows from E.hlValid onward in the background. Each row is
+// copied under the lock, lexed without it, and published only if nothing
+// changed in the meantime (E.hlGen). Rows near the viewport keep their
+// render/hl; rows further away only record their outgoing state.
+void *editorHlWorker(void *arg)
 {
-    size_t bufsize = 128;
-    char *buf = malloc(bufsize);
-    size_t buflen = 0;
-    buf[0] = '\0';
-    while (1)
+    (void)arg;
+    int skipped = 0;
+    // Scratch row whose buffers are kept between rows and swapped into the
+    // rows it publishes, so the worker seldom allocates.
+    editorRow work = {0};
+    char *text = NULL;
+    int textCap = 0;
+    pthread_mutex_lock(&E.lock);
+    while (!E.hlStop)
     {
-        editorSetStatusMessage(prompt, buf);
-        editorRefreshScreen();
-        int c = editorReadKey();
-        if (c == DELETE_KEY || c == CTRL_KEY('h') || c == BACKSPACE)
-        {
-            if (buflen != 0)
-                buf[--buflen] = '\0';
-        }
-        else if (c == '\x1b')
+        if (!editorHlCrossesLines() || E.hlValid >= E.numRows)
         {
-            editorSetStatusMessage("");
-            if (callback)
-                callback(buf, c);
-            free(buf);
-            return NULL;
+            pthread_cond_wait(&E.hlCond, &E.lock);
+            continue;
         }
-        else if (c == '\r')
+
+        int at = E.hlValid;
+        editorRow *row = editorRowAt(at);
+        int stateIn = at > 0 ? editorRowAt(at - 1)->hlStateOut : 0;
+        int keep = row->render != NULL ||
+                   (at >= E.rowOff - EDITOR_HL_WORKER_WINDOW &&
+                    at < E.rowOff + E.screenRows + EDITOR_HL_WORKER_WINDOW);
+        if (!row->renderDirty && row->hlStateIn == stateIn && (row->render || !keep))
         {
-            if (buflen != 0)
+            E.hlValid++;
+            if (++skipped % EDITOR_HL_WORKER_SKIPS == 0)
             {
-                editorSetStatusMessage("");
-                if (callback)
-                    callback(buf, c);
-                return buf;
+                pthread_mutex_unlock(&E.lock);
+                sched_yield();
+                pthread_mutex_lock(&E.lock);
             }
+            continue;
         }
-        else if (!iscntrl(c) && c < 128)
+
+        work.size = row->size;
+        work.numPieces = 0;
+        if (at == E.edit.row)
         {
-            if (buflen == bufsize - 1)
+            // The gap row's bytes change in place; lex a copy of them.
+            if (row->size > textCap)
             {
-                bufsize *= 2;
-                buf = realloc(buf, bufsize);
+                slabFree(text, textCap);
+                text = slabAlloc(row->size, &textCap);
             }
-            buf[buflen++] = c;
-            buf[buflen] = '\0';
+            textPiece copy = {text, row->size};
+            textRowCopy(row, text);
+            textRowInsertPieces(&work, 0, &copy, 1);
         }
-        if (callback)
-            callback(buf, c);
+        else if (row->numPieces)
+            textRowInsertPieces(&work, 0, row->pieces, row->numPieces);
+        work.hlStateIn = stateIn;
+        unsigned int gen = E.hlGen;
+        pthread_mutex_unlock(&E.lock);
+
+        editorRenderRow(&work);
+        editorUpdateSyntax(&work);
+
+        pthread_mutex_lock(&E.lock);
+        if (gen != E.hlGen || E.hlValid != at)
+            continue;
+        row = editorRowAt(at);
+        if (keep)
+        {
+            editorRow old = *row;
+            row->render = work.render;
+            row->hl = work.hl;
+            row->rsize = work.rsize;
+            row->renderCap = work.renderCap;
+            work.render = old.render;
+            work.hl = old.hl;
+            work.rsize = old.rsize;
+            work.renderCap = old.renderCap;
+        }
+        row->hlStateIn = stateIn;
+        row->hlStateOut = work.hlStateOut;
+        row->renderDirty = 0;
+        if (at == E.edit.row)
+            E.edit.numMarks = 0;
+        E.hlValid++;
+        if (at >= E.rowOff && at < E.rowOff + E.screenRows)
+            E.hlRedraw = 1;
     }
+    editorFreeRow(&work);
+    slabFree(text, textCap);
+    pthread_mutex_unlock(&E.lock);
+    return NULL;
 }
 
-void editorMoveCursor(int key)
+void editorStartHlWorker()
+{
+    if (!EDITOR_HL_WORKER)
+        return;
+    if (pthread_create(&E.hlThread, NULL, editorHlWorker, NULL) == 0)
+        E.hlWorker = 1;
+}
+
+void editorStopHlWorker()
+{
+    if (!E.hlWorker)
+        return;
+    E.hlStop = 1;
+    pthread_cond_signal(&E.hlCond);
+    pthread_mutex_unlock(&E.lock);
+    pthread_join(E.hlThread, NULL);
+    pthread_mutex_lock(&E.lock);
+    E.hlWorker = 0;
+}
+
+void editorInitRow(editorRow *row, const textPiece *pieces, int n)
 {
+    row->size = 0;
+    row->pieces = NULL;
+    row->numPieces = 0;
+    row->pieceCap = 0;
+    textRowAppendPieces(row, pieces, n);
 
-    editorRow *row = (E.cy >= E.numRows) ? NULL : &E.rows[E.cy];
+    row->rsize = 0;
+    row->renderCap = 0;
+    row->render = NULL;
+    row->hl = NULL;
+    row->hlStateIn = 0;
+    row->hlStateOut = 0;
+    editorUpdateRow(row);
+}
 
-    switch (key)
+void editorInsertRow(int at, const textPiece *pieces, int n)
+{
+    lineGapFlush();
+    lineIndexInitRows(at);
+    if (E.gapLen == 0)
     {
-    case ARROW_LEFT:
-        if (E.cx != 0)
-            E.cx--;
-        else if (E.cy > 0)
-        {
-            E.cy--;
-            E.cx = E.rows[E.cy].size - 1;
-        }
-        break;
-    case ARROW_RIGHT:
-        if (row && E.cx < row->size)
-            E.cx++;
-        else if (row && E.cx == row->size)
-        {
-            E.cy++;
-            E.cx = 0;
-        }
-        break;
-    case ARROW_UP:
-        if (E.cy != 0)
-            E.cy--;
-        break;
-    case ARROW_DOWN:
-        if (E.cy < E.numRows - 1)
-            E.cy++;
-        break;
+        int cap = E.numRows ? E.numRows * 2 : 16;
+        E.rows = realloc(E.rows, sizeof(editorRow) * cap);
+        if (E.rows == NULL)
+            die("realloc");
+        memmove(&E.rows[cap - (E.numRows - E.gapStart)], &E.rows[E.gapStart],
+                sizeof(editorRow) * (E.numRows - E.gapStart));
+        E.gapLen = cap - E.numRows;
     }
+    editorRowsMoveGap(at);
+    E.gapStart++;
+    E.gapLen--;
+    E.numRows++;
+    E.rowsFilled++;
+    E.rowsShift++;
 
-    row = (E.cy >= E.numRows) ? NULL : &E.rows[E.cy];
-    int rowLen = row ? row->size : 0;
-    if (E.cx > rowLen)
-        E.cx = rowLen;
+    editorInitRow(editorRowAt(at), pieces, n);
+    E.dirty++;
 }
 
-void editorProcessKeypress()
+// Moves render and hl columns [from, from + len) to `to`.
+void editorRowShift(editorRow *row, int from, int to, int len)
 {
-    static int quitTimes = EDITOR_QUIT_TIMES;
-    int c = editorReadKey();
-    switch (c)
-    {
-    case '\r':
-        editorInsertNewline();
-        break;
-    case BACKSPACE:
-    case CTRL_KEY('h'):
-    case DELETE_KEY:
-        if (c == DELETE_KEY)
-            editorMoveCursor(ARROW_RIGHT);
-        editorDelChar();
-        break;
-    case CTRL_KEY('s'):
-        if (E.dirty)
-            editorSave();
-        break;
-    case CTRL_KEY('f'):
-        editorFind();
-        break;
+    memmove(row->render + to, row->render + from, len);
+    memmove(row->hl + to, row->hl + from, len);
+}
 
-    case ARROW_DOWN:
-    case ARROW_LEFT:
-    case ARROW_RIGHT:
-    case ARROW_UP:
-        editorMoveCursor(c);
-        break;
-    case PAGE_UP:
-        E.cy = 0;
-        break;
-    case PAGE_DOWN:
-        if (E.cy < E.numRows)
-            E.cy = E.numRows - 1;
-        if (E.cx > E.rows[E.cy].size)
-            E.cx = E.rows[E.cy].size;
-        break;
-    case HOME_KEY:
-        E.cx = 0;
-        break;
-    case END_KEY:
-        E.cx = E.rows[E.cy].size;
-        break;
-    case CTRL_KEY('q'):
-        if (E.dirty && quitTimes > 0)
-        {
-            editorSetStatusMessage("File has unsaved changes. "
-                                   "Press Ctrl-Q %d more time to quit.",
-                                   quitTimes);
-            quitTimes--;
-            return;
-        }
-        write(STDOUT_FILENO, "\x1b[2J", 4);
-        write(STDOUT_FILENO, "\x1b[H", 3);
-        for (int i = 0; i < E.numRows; i++)
+// Brings render and hl of the gap row up to date after one byte was inserted
+// at cx, or `deleted` was removed from there, without rebuilding the row.
+// Render columns only shift up to the next tab, which ends on the same or
+// the next tab stop and so absorbs the change. The lexer restarts from the
+// last mark it cannot have been influenced past, and stops at the first
+// mark after the edit whose state it reproduces. Returns 0 when the row has
+// no current render to patch.
+int lineGapPatch(editorRow *row, int cx, int ins, char deleted)
+{
+    lineGap *g = &E.edit;
+    if (!g->numMarks || !row->render || row->renderDirty || row->hlStateIn == HL_STATE_UNKNOWN)
+        return 0;
+
+    int k = lineGapFindMark(cx);
+    int rx0 = lineGapCxToRx(cx);
+    char c = ins ? lineGapByte(cx) : deleted;
+    int width = c == '\t' ? EDITOR_TAB_STOP - rx0 % EDITOR_TAB_STOP : 1;
+    int newAt = rx0 + (ins ? width : 0);
+    int oldAt = rx0 + (ins ? 0 : width);
+    int d = newAt - oldAt;
+
+    // Everything up to the next tab moves by d; the tab itself ends on a
+    // tab stop, and what follows it moves by whole tab stops, if at all.
+    const char *after = g->buf + g->end;
+    const char *tab = memchr(after, '\t', g->cap - g->end);
+    int n = tab ? tab - after : g->cap - g->end;
+    int oldEnd = oldAt + n;
+    int newEnd = newAt + n;
+    unsigned char tabHl = HL_NORMAL;
+    if (tab)
+    {
+        tabHl = row->hl[oldAt + n];
+        oldEnd = (oldAt + n) / EDITOR_TAB_STOP * EDITOR_TAB_STOP + EDITOR_TAB_STOP;
+        newEnd = (newAt + n) / EDITOR_TAB_STOP * EDITOR_TAB_STOP + EDITOR_TAB_STOP;
+    }
+    int shift = newEnd - oldEnd;
+    editorRowReserve(row, row->rsize + shift);
+    if (d >= 0)
+    {
+        editorRowShift(row, oldEnd, newEnd, row->rsize - oldEnd);
+        editorRowShift(row, oldAt, newAt, n);
+    }
+    else
+    {
+        editorRowShift(row, oldAt, newAt, n);
+        editorRowShift(row, oldEnd, newEnd, row->rsize - oldEnd);
+    }
+    if (tab)
+    {
+        memset(row->render + newAt + n, ' ', newEnd - newAt - n);
+        memset(row->hl + newAt + n, tabHl, newEnd - newAt - n);
+    }
+    if (ins)
+    {
+        memset(row->render + rx0, c == '\t' ? ' ' : c, width);
+        memset(row->hl + rx0, HL_NORMAL, width);
+    }
+    row->rsize += shift;
+    row->render[row->rsize] = '\0';
+
+    for (int j = k + 1; j < g->numMarks; j++)
+    {
+        g->marks[j].cx += ins ? 1 : -1;
+        g->marks[j].rx += !tab || g->marks[j].rx < oldEnd ? d : shift;
+    }
+    if (!ins && g->marks[k].cx == cx)
+    {
+        // This mark now names the byte after the deleted one.
+        if (k + 1 < g->numMarks && g->marks[k + 1].cx == cx)
         {
-            editorFreeRow(&E.rows[i]);
+            memmove(&g->marks[k], &g->marks[k + 1], sizeof(renderMark) * (g->numMarks - k - 1));
+            g->numMarks--;
         }
-        free(E.rows);
-        free(E.filename);
+        else
+            g->marks[k].hlState = HL_STATE_UNKNOWN;
+    }
+    int next = k + 1 < g->numMarks ? g->marks[k + 1].cx : row->size;
+    if (cx > g->marks[k].cx && next - g->marks[k].cx > 2 * EDITOR_RENDER_MARK)
+        lineGapAddMark(++k, cx, rx0);
 
-        exit(EXIT_SUCCESS);
-        break;
-    case CTRL_KEY('l'):
-    case '\x1b':
-        break;
-    default:
-        if (!iscntrl(c))
-            editorInsertChar(c);
-        break;
+    if (E.syntax == NULL)
+        return 1;
+
+    // A token is decided by looking ahead: to the end of a word, or across
+    // a comment delimiter or an escaped character.
+    int ahead = 1;
+    const char *delims[] = {E.syntax->singlelineCommentStart, E.syntax->multilineCommentStart,
+                            E.syntax->multilineCommentEnd};
+    for (int j = 0; j < 3; j++)
+        if (delims[j] && (int)strlen(delims[j]) - 1 > ahead)
+            ahead = strlen(delims[j]) - 1;
+    int limit = rx0 - ahead;
+    while (limit > 0 && !is_separator(row->render[limit - 1]))
+        limit--;
+
+    int j = k;
+    while (j >= 0 && (g->marks[j].rx > limit || g->marks[j].hlState == HL_STATE_UNKNOWN))
+        j--;
+    if (j >= 0)
+        editorUpdateSyntaxFrom(row, g->marks[j].rx, g->marks[j].hlState, g->marks, g->numMarks,
+                               newAt);
+    else
+        editorUpdateSyntaxFrom(row, 0, row->hlStateIn | HL_STATE_PREV_SEP, g->marks, g->numMarks,
+                               newAt);
+    return 1;
+}
+
+// Refreshes the gap row after an edit at cx: patched in place when possible,
+// otherwise marked for a full rebuild.
+void lineGapUpdate(editorRow *row, int cx, int ins, char deleted)
+{
+    int stateOut = row->hlStateOut;
+    if (!lineGapPatch(row, cx, ins, deleted))
+    {
+        E.edit.numMarks = 0;
+        editorUpdateRow(row);
+        return;
     }
+    E.hlGen++;
+    if (row->hlStateOut != stateOut && E.edit.row + 1 < E.hlValid)
+        E.hlValid = E.edit.row + 1;
+}
 
-    quitTimes = EDITOR_QUIT_TIMES;
+void editorRowInsertChar(editorRow *row, int at, int c)
+{
+    if (at < 0 || at > row->size)
+        at = row->size;
+
+    lineGap *g = lineGapFor(row);
+    if (at < g->head)
+        g->head = at;
+    if (row->size - at < g->tail)
+        g->tail = row->size - at;
+    lineGapGrow(1);
+    lineGapMove(at);
+    g->buf[g->start++] = c;
+    lineGapPublish();
+    lineGapUpdate(row, at, 1, 0);
 }
 
-// Syntax highlighting
+void editorInsertChar(int c)
+{
+    if (E.cy == E.numRows)
+    {
+        undoPush(UNDO_ADD_ROW, E.numRows, 0, NULL, 0);
+        editorInsertRow(E.numRows, NULL, 0);
+    }
+    undoPushTyped(E.cy, E.cx, c);
+    editorRowInsertChar(editorRowAt(E.cy), E.cx, c);
+    E.cx++;
+    E.dirty++;
+}
 
-int is_separator(int c)
+// Breaks row `at` before byte `col`; the text after it becomes row at + 1.
+void editorSplitRow(int at, int col)
 {
-    return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+    lineGapFlush();
+    if (col == 0)
+    {
+        editorInsertRow(at, NULL, 0);
+        return;
+    }
+    editorRow *row = editorRowAt(at);
+    int split = textRowSplit(row, col);
+    editorInsertRow(at + 1, &row->pieces[split], row->numPieces - split);
+    row = editorRowAt(at);
+    textRowTruncate(row, col);
+    editorUpdateRow(row);
 }
 
-int editorSyntaxToColor(int hl)
+// Appends row at + 1 to row `at` and removes it.
+void editorJoinRow(int at)
 {
-    switch (hl)
+    lineGapFlush();
+    editorRow *next = editorRowAt(at + 1);
+    editorRowAppendPieces(editorRowAt(at), next->pieces, next->numPieces);
+    editorDeleteRow(at + 1);
+}
+
+void editorInsertNewline()
+{
+    if (E.cy == E.numRows)
     {
-    case HL_KEYWORD1:
-        return 33;
-    case HL_KEYWORD2:
-        return 32;
-    case HL_COMMENT:
-    case HL_ML_COMMENT:
-        return 36;
-    case HL_STRING:
-        return 35;
-    case HL_NUMBER:
-        return 31;
-    case HL_MATCH:
-        return 34;
-    default:
-        return 37;
+        undoPush(UNDO_ADD_ROW, E.cy, 0, NULL, 0);
+        editorInsertRow(E.cy, NULL, 0);
     }
+    else
+    {
+        undoPush(UNDO_SPLIT, E.cy, E.cx, NULL, 0);
+        editorSplitRow(E.cy, E.cx);
+    }
+    E.cy++;
+    E.cx = 0;
 }
 
-void editorUpdateSyntax(editorRow *row)
+void editorRowDelChar(editorRow *row, int at)
 {
-    row->hl = realloc(row->hl, row->rsize);
-    memset(row->hl, HL_NORMAL, row->rsize);
+    if (at < 0 || at >= row->size)
+        return;
 
-    if (E.syntax == NULL)
+    lineGap *g = lineGapFor(row);
+    if (at < g->head)
+        g->head = at;
+    if (row->size - at - 1 < g->tail)
+        g->tail = row->size - at - 1;
+    char deleted = lineGapByte(at);
+    lineGapMove(at);
+    g->end++;
+    lineGapPublish();
+    lineGapUpdate(row, at, 0, deleted);
+    E.dirty++;
+}
+
+void editorDelChar()
+{
+    if (E.cy == E.numRows)
+        return;
+    if (E.cx == 0 && E.cy == 0)
         return;
 
-    char **keywords = E.syntax->keywords;
+    editorRow *row = editorRowAt(E.cy);
 
-    char *comment = E.syntax->singlelineCommentStart;
-    char *mlCommentStart = E.syntax->multilineCommentStart;
-    char *mlCommentEnd = E.syntax->multilineCommentEnd;
+    if (E.cx > 0)
+    {
+        char c;
+        textRowRead(row, E.cx - 1, 1, &c);
+        undoPush(UNDO_DELETE, E.cy, E.cx - 1, &c, 1);
+        editorRowDelChar(row, E.cx - 1);
+        E.cx--;
+    }
+    else
+    {
+        E.cx = editorRowAt(E.cy - 1)->size;
+        undoPush(UNDO_JOIN, E.cy - 1, E.cx, NULL, 0);
+        editorJoinRow(E.cy - 1);
+        E.cy--;
+    }
+}
 
-    int commentLen = comment ? strlen(comment) : 0;
-    int mlCommentStartLen = mlCommentStart ? strlen(mlCommentStart) : 0;
-    int mlCommentEndLen = mlCommentEnd ? strlen(mlCommentEnd) : 0;
+// Undo
+
+size_t undoRecordSize(const undoRecord *r)
+{
+    return sizeof(undoRecord) + r->len;
+}
 
-    int prevSep = 1;
-    int inString = 0;
-    int inComment = (row->idx > 0 && E.rows[row->idx - 1].hlOpenComment);
+void undoRead(size_t off, undoRecord *r)
+{
+    memcpy(r, E.undo.buf + off, sizeof(undoRecord));
+}
 
-    int i = 0;
-    while (i < row->rsize)
-    {
-        char c = row->render[i];
-        unsigned char prevHL = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
+void undoReserve(size_t len)
+{
+    undoLog *u = &E.undo;
+    if (u->len + len <= u->cap)
+        return;
+    size_t cap = u->cap ? u->cap : 4096;
+    while (cap < u->len + len)
+        cap *= 2;
+    char *buf = realloc(u->buf, cap);
+    if (buf == NULL)
+        die("realloc");
+    u->buf = buf;
+    u->cap = cap;
+}
 
-        // highlight comments
-        if (commentLen && !inString && !inComment)
+// Drops whole groups from the front of the log until it fits the budget. An
+// action that is over budget by itself is not kept at all.
+void undoTrim()
+{
+    undoLog *u = &E.undo;
+    undoRecord r;
+    while (u->len - u->start > EDITOR_UNDO_BUDGET)
+    {
+        undoRead(u->start, &r);
+        if (r.group == u->group)
         {
-            if (!strncmp(&row->render[i], comment, commentLen))
-            {
-                memset(&row->hl[i], HL_COMMENT, row->rsize - i);
-                break;
-            }
+            u->start = u->pos = u->len = 0;
+            u->last = -1;
+            u->dropGroup = u->group;
+            return;
         }
-
-        if (mlCommentStartLen && mlCommentEndLen && !inString)
+        int group = r.group;
+        while (u->start < u->pos)
         {
-            if (inComment)
-            {
-                row->hl[i] = HL_ML_COMMENT;
-                if (!strncmp(&row->render[i], mlCommentEnd, mlCommentEndLen))
-                {
-                    memset(&row->hl[i], HL_ML_COMMENT, mlCommentEndLen);
-                    i += mlCommentEndLen;
-                    inComment = 0;
-                    prevSep = 1;
-                    continue;
-                }
-                else
-                {
-                    i++;
-                    continue;
-                }
-            }
-            else if (!strncmp(&row->render[i], mlCommentStart, mlCommentStartLen))
-            {
-                memset(&row->hl[i], HL_ML_COMMENT, mlCommentStartLen);
-                i += mlCommentStartLen;
-                inComment = 1;
-                continue;
-            }
+            undoRead(u->start, &r);
+            if (r.group != group)
+                break;
+            u->start += undoRecordSize(&r);
         }
+        if (u->start == u->pos)
+            u->last = -1;
+    }
+    if (u->start > u->cap / 2)
+    {
+        memmove(u->buf, u->buf + u->start, u->len - u->start);
+        u->pos -= u->start;
+        u->len -= u->start;
+        if (u->last >= 0)
+            u->last -= u->start;
+        u->start = 0;
+    }
+}
 
-        // highlight strings
-        if (E.syntax->flags & HL_HIGHLIGHT_STRINGS)
+// Appends a record to the current group, discarding anything that could
+// still be redone.
+void undoPush(int type, int row, int col, const char *text, int len)
+{
+    undoLog *u = &E.undo;
+    u->typing = 0;
+    journalAppend(type, row, col, text, len);
+    if (u->group == u->dropGroup)
+        return;
+    u->len = u->pos;
+    undoReserve(sizeof(undoRecord) + len);
+    undoRecord r = {type, u->group, row, col, len, u->last >= 0 ? (int)(u->pos - u->last) : 0};
+    memcpy(u->buf + u->len, &r, sizeof(undoRecord));
+    if (len)
+        memcpy(u->buf + u->len + sizeof(undoRecord), text, len);
+    u->last = u->len;
+    u->len += undoRecordSize(&r);
+    u->pos = u->len;
+    undoTrim();
+}
+
+// A character typed right after the previous one, at the column it left
+// off, extends that record, so a run of typing is undone in one step. The
+// record moves into the new group only if it is alone in its own; one that
+// shares a group (say with the row typing created) is left to undo with it.
+void undoPushTyped(int row, int col, char c)
+{
+    undoLog *u = &E.undo;
+    if (u->typing && u->last >= 0 && u->pos == u->len && u->group != u->dropGroup)
+    {
+        undoRecord r, prev;
+        undoRead(u->last, &r);
+        int alone = 1;
+        if ((size_t)u->last > u->start)
         {
-            if (inString)
-            {
-                row->hl[i] = HL_STRING;
-                if (c == '\\' && i + 1 < row->rsize)
-                {
-                    row->hl[i + 1] = HL_STRING;
-                    i += 2;
-                    continue;
-                }
-                if (c == inString)
-                    inString = 0;
-                i++;
-                prevSep = 1;
-                continue;
-            }
-            else if (c == '"' || c == '\'')
-            {
-                inString = c;
-                row->hl[i] = HL_STRING;
-                i++;
-                continue;
-            }
+            undoRead(u->last - r.prevSize, &prev);
+            alone = prev.group != r.group;
         }
-
-        // highlight numbers
-        if (E.syntax->flags & HL_HIGHLIGHT_NUMBERS)
+        if (alone && r.type == UNDO_INSERT && r.group == u->group - 1 && r.row == row &&
+            r.col + r.len == col)
         {
-            if ((isdigit(c) && (prevSep || prevHL == HL_NUMBER)) ||
-                (c == '.' && prevHL == HL_NUMBER))
-            {
-                row->hl[i] = HL_NUMBER;
-                i++;
-                prevSep = 0;
-                continue;
-            }
+            journalAppend(UNDO_INSERT, row, col, &c, 1);
+            undoReserve(1);
+            u->buf[u->len++] = c;
+            u->pos = u->len;
+            r.len++;
+            r.group = u->group;
+            memcpy(u->buf + u->last, &r, sizeof(undoRecord));
+            undoTrim();
+            return;
         }
+    }
+    undoPush(UNDO_INSERT, row, col, &c, 1);
+    u->typing = 1;
+}
 
-        // highlight keywords
-        if (prevSep)
+// Replays a record, or its inverse, and leaves the cursor where it applies.
+void undoApply(const undoRecord *r, const char *text, int inverse)
+{
+    static const int opposite[] = {UNDO_DELETE, UNDO_INSERT, UNDO_JOIN,
+                                   UNDO_SPLIT, UNDO_DEL_ROW, UNDO_ADD_ROW};
+    int type = inverse ? opposite[r->type] : r->type;
+    journalAppend(type, r->row, r->col, text, r->len);
+    lineGapFlush();
+    E.cy = r->row;
+    E.cx = r->col;
+    switch (type)
+    {
+    case UNDO_INSERT:
+        textRowInsert(editorRowAt(r->row), r->col, text, r->len);
+        editorUpdateRow(editorRowAt(r->row));
+        if (!inverse)
+            E.cx += r->len;
+        break;
+    case UNDO_DELETE:
+        textRowDelete(editorRowAt(r->row), r->col, r->len);
+        editorUpdateRow(editorRowAt(r->row));
+        break;
+    case UNDO_SPLIT:
+        editorSplitRow(r->row, r->col);
+        if (!inverse)
         {
-            int j;
-            for (j = 0; keywords[j]; j++)
-            {
-                int klen = strlen(keywords[j]);
-                int kw2 = keywords[j][klen - 1] == '|';
-                if (kw2)
-                    klen--;
+            E.cy++;
+            E.cx = 0;
+        }
+        break;
+    case UNDO_JOIN:
+        editorJoinRow(r->row);
+        break;
+    case UNDO_ADD_ROW:
+        editorInsertRow(r->row, NULL, 0);
+        break;
+    case UNDO_DEL_ROW:
+        editorDeleteRow(r->row);
+        break;
+    }
+    E.dirty++;
+}
 
-                if (!strncmp(&row->render[i], keywords[j], klen) &&
-                    is_separator(row->render[i + klen]))
+void editorUndo()
+{
+    undoLog *u = &E.undo;
+    u->typing = 0;
+    if (u->pos == u->start)
+    {
+        editorSetStatusMessage("Nothing to undo");
+        return;
+    }
+    undoRecord r;
+    undoRead(u->last, &r);
+    int group = r.group;
+    while (1)
+    {
+        undoApply(&r, u->buf + u->last + sizeof(undoRecord), 1);
+        u->pos = u->last;
+        u->last = u->pos > u->start ? (long)(u->pos - r.prevSize) : -1;
+        if (u->last < 0)
+            break;
+        undoRead(u->last, &r);
+        if (r.group != group)
+            break;
+    }
+}
+
+void editorRedo()
+{
+    undoLog *u = &E.undo;
+    u->typing = 0;
+    if (u->pos == u->len)
+    {
+        editorSetStatusMessage("Nothing to redo");
+        return;
+    }
+    undoRecord r;
+    undoRead(u->pos, &r);
+    int group = r.group;
+    while (1)
+    {
+        undoApply(&r, u->buf + u->pos + sizeof(undoRecord), 0);
+        u->last = u->pos;
+        u->pos += undoRecordSize(&r);
+        if (u->pos == u->len)
+            break;
+        undoRead(u->pos, &r);
+        if (r.group != group)
+            break;
+    }
+}
+
+// Line index
+
+void lineScanEmit(lineScanState *st, const char *nl)
+{
+    if (st->out)
+    {
+        const char *lineEnd = nl;
+        while (lineEnd > st->lineStart && lineEnd[-1] == '\r')
+            lineEnd--;
+        st->out[st->count].start = st->lineStart;
+        st->out[st->count].len = lineEnd - st->lineStart;
+    }
+    st->lineStart = nl + 1;
+    st->count++;
+}
+
+void lineScanMask(lineScanState *st, const char *base, unsigned int mask)
+{
+    if (st->out == NULL)
+    {
+        st->count += __builtin_popcount(mask);
+        return;
+    }
+    while (mask)
+    {
+        lineScanEmit(st, base + __builtin_ctz(mask));
+        mask &= mask - 1;
+    }
+}
+
+void lineScanScalar(lineScanState *st, const char *p, const char *end)
+{
+    while (p < end)
+    {
+        const char *nl = memchr(p, '\n', end - p);
+        if (nl == NULL)
+            break;
+        lineScanEmit(st, nl);
+        p = nl + 1;
+    }
+}
+
+#ifdef __SSE2__
+void lineScanSSE2(lineScanState *st, const char *p, const char *end)
+{
+    const __m128i nl = _mm_set1_epi8('\n');
+    for (; end - p >= 16; p += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        lineScanMask(st, p, _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl)));
+    }
+    lineScanScalar(st, p, end);
+}
+#endif
+
+#ifdef LINE_SCAN_X86
+__attribute__((target("avx2"))) void lineScanAVX2(lineScanState *st, const char *p, const char *end)
+{
+    const __m256i nl = _mm256_set1_epi8('\n');
+    for (; end - p >= 32; p += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)p);
+        lineScanMask(st, p, (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl)));
+    }
+    lineScanScalar(st, p, end);
+}
+#endif
+
+lineScanFn lineScanPick()
+{
+#ifdef LINE_SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return lineScanAVX2;
+#endif
+#ifdef __SSE2__
+    return lineScanSSE2;
+#else
+    return lineScanScalar;
+#endif
+}
+
+// Opening a file only builds E.text.lines; a row is set up from its line
+// when first reached, EDITOR_FILL_ROWS at a time, so a large file does not
+// pay for millions of rows before its first frame. Rows from E.rowsFilled
+// on are not set up yet, and row `at` among them is still line
+// `at - E.rowsShift`: rows inserted or deleted before it move it.
+void lineIndexInitRows(int to)
+{
+    if (to > E.numRows)
+        to = E.numRows;
+    for (int at = E.rowsFilled; at < to; at++)
+    {
+        editorRow *row = &E.rows[at < E.gapStart ? at : at + E.gapLen];
+        textPiece *line = &E.text.lines[at - E.rowsShift];
+        row->size = line->len;
+        row->pieces = line;
+        row->numPieces = row->size ? 1 : 0;
+        row->pieceCap = 0;
+        row->rsize = 0;
+        row->renderCap = 0;
+        row->render = NULL;
+        row->hl = NULL;
+        row->renderDirty = 1;
+        row->hlStateIn = 0;
+        row->hlStateOut = 0;
+    }
+    if (to > E.rowsFilled)
+        E.rowsFilled = to;
+}
+
+void *lineIndexCount(void *arg)
+{
+    lineIndexChunk *c = arg;
+    lineScanState st = {c->start, NULL, 0};
+    c->scan(&st, c->start, c->end);
+    c->count = st.count;
+    c->lastNewline = st.count ? memrchr(c->start, '\n', c->end - c->start) : NULL;
+    return NULL;
+}
+
+void *lineIndexFill(void *arg)
+{
+    lineIndexChunk *c = arg;
+    lineScanState st = {c->lineStart, &E.text.lines[c->first], 0};
+    c->scan(&st, c->start, c->end);
+    return NULL;
+}
+
+void lineIndexRun(void *(*fn)(void *), lineIndexChunk *chunks, int n)
+{
+    pthread_t threads[EDITOR_INDEX_MAX_THREADS];
+    int started = 0;
+    for (int j = 1; j < n; j++)
+    {
+        if (pthread_create(&threads[j], NULL, fn, &chunks[j]) != 0)
+            break;
+        started = j;
+    }
+    for (int j = started + 1; j < n; j++)
+        fn(&chunks[j]);
+    fn(&chunks[0]);
+    for (int j = 1; j <= started; j++)
+        pthread_join(threads[j], NULL);
+}
+
+// Splits the file into chunks that are scanned in parallel: one pass counts
+// newlines so E.text.lines and E.rows can be sized exactly, a second pass
+// writes every line's piece straight into its final slot. The rows
+// themselves are left for lineIndexInitRows.
+void lineIndexBuild()
+{
+    const char *text = E.text.orig;
+    size_t len = E.text.origLen;
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int n = len / EDITOR_INDEX_CHUNK + 1;
+    if (cpus > 0 && n > cpus)
+        n = cpus;
+    if (n > EDITOR_INDEX_MAX_THREADS)
+        n = EDITOR_INDEX_MAX_THREADS;
+
+    lineIndexChunk chunks[EDITOR_INDEX_MAX_THREADS];
+    lineScanFn scan = lineScanPick();
+    for (int j = 0; j < n; j++)
+    {
+        chunks[j].start = text + len * j / n;
+        chunks[j].end = text + len * (j + 1) / n;
+        chunks[j].scan = scan;
+    }
+    lineIndexRun(lineIndexCount, chunks, n);
+
+    int lines = 0;
+    const char *lineStart = text;
+    for (int j = 0; j < n; j++)
+    {
+        chunks[j].first = lines;
+        chunks[j].lineStart = lineStart;
+        lines += chunks[j].count;
+        if (chunks[j].lastNewline)
+            lineStart = chunks[j].lastNewline + 1;
+    }
+    int tail = lineStart < text + len;
+
+    E.text.lines = malloc(sizeof(textPiece) * (lines + tail + 1));
+    E.rows = malloc(sizeof(editorRow) * (lines + tail + 1));
+    if (E.text.lines == NULL || E.rows == NULL)
+        die("malloc");
+    lineIndexRun(lineIndexFill, chunks, n);
+
+    if (tail)
+    {
+        lineScanState st = {lineStart, &E.text.lines[lines], 0};
+        lineScanEmit(&st, text + len);
+    }
+    E.numRows = lines + tail;
+    E.gapStart = E.numRows;
+    E.gapLen = 1 - tail;
+    E.rowsFilled = 0;
+    E.rowsShift = 0;
+}
+
+// Paging
+
+// Where line `*line` starts, found by scanning from the nearest line start
+// already known: a mark of the index, or the window's first row. A line past
+// the end of the file is clamped to the last one, and *line updated.
+size_t pageSeek(long long *line)
+{
+    const char *text = E.text.orig;
+    const char *end = text + E.text.origLen;
+    pageIndex *pg = &E.page;
+    long long k = *line / EDITOR_PAGE_STRIDE;
+    if (k >= pg->numMarks)
+        k = pg->numMarks - 1;
+    long long from = k * EDITOR_PAGE_STRIDE;
+    size_t at = pg->marks[k];
+
+    if (*line < pg->first && pg->first - *line < *line - from)
+    {
+        long long n = pg->first - *line;
+        at = pg->firstOffset;
+        for (; n > 0 && at > 0; n--)
+        {
+            const char *nl = memrchr(text, '\n', at - 1);
+            at = nl ? (size_t)(nl - text) + 1 : 0;
+        }
+        *line += n;
+        return at;
+    }
+    if (*line >= pg->first && pg->first > from)
+    {
+        from = pg->first;
+        at = pg->firstOffset;
+    }
+    const char *p = text + at;
+    long long n = *line - from;
+    for (; n > 0; n--)
+    {
+        const char *nl = memchr(p, '\n', end - p);
+        if (nl == NULL || nl + 1 == end)
+            break;
+        p = nl + 1;
+    }
+    *line -= n;
+    return p - text;
+}
+
+// Drops the mapped pages outside [from, to) from the process; they are
+// read back from the page cache if seen again.
+void pageRelease(size_t from, size_t to)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    from = from / page * page;
+    to = (to + page - 1) / page * page;
+    if (from > 0)
+        madvise(E.text.orig, from, MADV_DONTNEED);
+    if (to < E.text.origLen)
+        madvise(E.text.orig + to, E.text.origLen - to, MADV_DONTNEED);
+}
+
+// Replaces the window with the rows from line `first` on. The cursor and
+// the view stay on the same lines of the file.
+void pageLoad(long long first)
+{
+    pageIndex *pg = &E.page;
+    if (first < 0)
+        first = 0;
+    size_t offset = pageSeek(&first);
+    const char *text = E.text.orig;
+    const char *end = text + E.text.origLen;
+
+    for (int j = 0; j < E.numRows; j++)
+        editorFreeRow(editorRowAt(j));
+    lineScanState st = {text + offset, E.text.lines, 0};
+    const char *p = text + offset;
+    while (st.count < EDITOR_PAGE_ROWS)
+    {
+        const char *nl = memchr(p, '\n', end - p);
+        if (nl == NULL)
+            break;
+        lineScanEmit(&st, nl);
+        p = nl + 1;
+    }
+    if (st.count < EDITOR_PAGE_ROWS && st.lineStart < end)
+        lineScanEmit(&st, end);
+    E.numRows = st.count;
+    E.gapStart = E.numRows;
+    E.gapLen = 0;
+    E.rowsFilled = 0;
+    E.rowsShift = 0;
+    lineIndexInitRows(E.numRows);
+
+    long long d = first - pg->first;
+    if (d > EDITOR_PAGE_ROWS || d < -EDITOR_PAGE_ROWS)
+    {
+        // None of the old rows is left; the caller places the cursor.
+        E.cy = 0;
+        E.rowOff = 0;
+        E.screen.valid = 0;
+    }
+    else
+    {
+        E.cy -= d;
+        E.rowOff -= d;
+        E.screen.rowOff -= d;
+    }
+    if (E.rowOff < 0)
+        E.rowOff = 0;
+    pg->first = first;
+    pg->firstOffset = offset;
+    pg->atEnd = st.lineStart >= end;
+    pageRelease(offset, st.lineStart - text);
+
+    searchIndexFree(&E.search);
+    E.hlGen++;
+    E.hlValid = 0;
+}
+
+// Slides the window once the cursor is within a quarter of it of an end
+// that is not the end of the file, so moving line by line never leaves it.
+void pageFollow()
+{
+    pageIndex *pg = &E.page;
+    if (!pg->active)
+        return;
+    int margin = EDITOR_PAGE_ROWS / 4;
+    if ((E.cy < margin && pg->first > 0) || (E.cy >= E.numRows - margin && !pg->atEnd))
+        pageLoad(pg->first + E.cy - EDITOR_PAGE_ROWS / 2);
+    if (E.cy < 0)
+        E.cy = 0;
+    if (E.cy > E.numRows)
+        E.cy = E.numRows;
+}
+
+// Scrolls the view and the cursor by `n` lines, sliding the window first if
+// that would leave it.
+void pageScroll(int n)
+{
+    pageIndex *pg = &E.page;
+    if ((n < 0 && E.rowOff + n < 0 && pg->first > 0) ||
+        (n > 0 && E.rowOff + E.screenRows + n > E.numRows && !pg->atEnd))
+        pageLoad(pg->first + E.cy + n - EDITOR_PAGE_ROWS / 2);
+    E.rowOff += n;
+    E.cy += n;
+    if (E.rowOff > E.numRows - E.screenRows)
+        E.rowOff = E.numRows - E.screenRows;
+    if (E.rowOff < 0)
+        E.rowOff = 0;
+    if (E.cy >= E.numRows)
+        E.cy = E.numRows - 1;
+    if (E.cy < 0)
+        E.cy = 0;
+}
+
+// Moves the cursor to line `line` of the file. Lines past what the index
+// has counted yet are out of reach until it gets there.
+void pageGoto(long long line)
+{
+    pageIndex *pg = &E.page;
+    if (line >= pg->lines)
+    {
+        line = pg->lines ? pg->lines - 1 : 0;
+        if (!pg->done)
+            editorSetStatusMessage("Still indexing: %lld lines so far", pg->lines);
+    }
+    pageLoad(line - EDITOR_PAGE_ROWS / 2);
+    E.cy = line - pg->first;
+    if (E.cy >= E.numRows)
+        E.cy = E.numRows - 1;
+}
+
+// Counts the lines of the file chunk by chunk and records a mark every
+// EDITOR_PAGE_STRIDE lines. Scanned pages are released behind it, so the
+// scan does not grow the process by the size of the file.
+void *pageIndexRun(void *arg)
+{
+    (void)arg;
+    pageIndex *pg = &E.page;
+    const char *text = E.text.orig;
+    size_t len = E.text.origLen;
+    lineScanFn scan = lineScanPick();
+    long long lines = 0;
+    long long next = EDITOR_PAGE_STRIDE;
+    size_t *found = NULL;
+    int foundCap = 0;
+
+    for (size_t at = 0; at < len; at += EDITOR_INDEX_CHUNK)
+    {
+        size_t n = len - at < EDITOR_INDEX_CHUNK ? len - at : EDITOR_INDEX_CHUNK;
+        const char *p = text + at;
+        lineScanState st = {p, NULL, 0};
+        scan(&st, p, p + n);
+
+        int numFound = 0;
+        for (long long seen = lines; lines + st.count >= next; next += EDITOR_PAGE_STRIDE)
+        {
+            const char *nl = p - 1;
+            for (; seen < next; seen++)
+                nl = memchr(nl + 1, '\n', text + at + n - (nl + 1));
+            p = nl + 1;
+            if ((size_t)(p - text) == len)
+                break;
+            if (numFound == foundCap)
+            {
+                foundCap = foundCap ? foundCap * 2 : 16;
+                found = realloc(found, sizeof(size_t) * foundCap);
+                if (found == NULL)
+                    die("realloc");
+            }
+            found[numFound++] = p - text;
+        }
+        lines += st.count;
+        madvise((char *)text + at, n, MADV_DONTNEED);
+
+        pthread_mutex_lock(&E.lock);
+        if (pg->numMarks + numFound > pg->markCap)
+        {
+            while (pg->numMarks + numFound > pg->markCap)
+                pg->markCap *= 2;
+            pg->marks = realloc(pg->marks, sizeof(size_t) * pg->markCap);
+            if (pg->marks == NULL)
+                die("realloc");
+        }
+        memcpy(&pg->marks[pg->numMarks], found, sizeof(size_t) * numFound);
+        pg->numMarks += numFound;
+        pg->lines = lines;
+        pg->changed = 1;
+        int stop = pg->stop;
+        pthread_mutex_unlock(&E.lock);
+        if (stop)
+            break;
+    }
+    free(found);
+
+    pthread_mutex_lock(&E.lock);
+    if (!pg->stop)
+    {
+        pg->lines = lines + (len && text[len - 1] != '\n');
+        pg->done = 1;
+        pg->changed = 1;
+    }
+    pthread_mutex_unlock(&E.lock);
+    return NULL;
+}
+
+// Opens the mapped file in paging mode: shows its first rows and starts
+// counting the rest.
+void pageOpen()
+{
+    pageIndex *pg = &E.page;
+    pg->active = 1;
+    pg->markCap = 1024;
+    pg->marks = malloc(sizeof(size_t) * pg->markCap);
+    E.text.lines = malloc(sizeof(textPiece) * EDITOR_PAGE_ROWS);
+    E.rows = malloc(sizeof(editorRow) * EDITOR_PAGE_ROWS);
+    if (pg->marks == NULL || E.text.lines == NULL || E.rows == NULL)
+        die("malloc");
+    pg->marks[0] = 0;
+    pg->numMarks = 1;
+    pg->first = 0;
+    pg->firstOffset = 0;
+    E.numRows = 0;
+    pageLoad(0);
+    pg->indexing = pthread_create(&pg->thread, NULL, pageIndexRun, NULL) == 0;
+    editorSetStatusMessage("%.1f GB file: read-only paging mode | Ctrl-G = go to line",
+                           E.text.origLen / 1e9);
+}
+
+void pageClose()
+{
+    pageIndex *pg = &E.page;
+    if (pg->indexing)
+    {
+        pg->stop = 1;
+        pthread_mutex_unlock(&E.lock);
+        pthread_join(pg->thread, NULL);
+        pthread_mutex_lock(&E.lock);
+        pg->indexing = 0;
+    }
+    free(pg->marks);
+    pg->marks = NULL;
+}
+
+// Refuses an edit in paging mode.
+int editorReadOnly()
+{
+    if (!E.page.active)
+        return 0;
+    editorSetStatusMessage("Read-only: the file is too large to edit");
+    return 1;
+}
+
+// file IO operations
+
+// Writes iov[0..n) in full, resuming after short writes and EINTR.
+int editorWriteAll(int fd, struct iovec *iov, int n)
+{
+    while (n > 0)
+    {
+        ssize_t w = writev(fd, iov, n);
+        if (w == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        while (n > 0 && (size_t)w >= iov->iov_len)
+        {
+            w -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + w;
+            iov->iov_len -= w;
+        }
+    }
+    return 0;
+}
+
+// Takes the rows as write slices for a save. Text in the original and the add
+// buffer never changes, so the slices stay valid while editing goes on; only
+// the gap row is mutable, and it is folded back first. Slices that meet in
+// memory are merged, which turns unedited stretches of the mapped file,
+// newlines included, into one slice.
+void editorSaveSnapshot(editorSaveJob *job)
+{
+    static const char newline[] = "\n";
+    const char *orig = E.text.orig;
+    const char *origEnd = orig + E.text.origLen;
+    lineGapFlush();
+    job->count = 0;
+    job->len = 0;
+
+    for (int j = 0; j < E.numRows; j++)
+    {
+        editorRow *row = editorRowAt(j);
+        for (int k = 0; k <= row->numPieces; k++)
+        {
+            const char *s = k < row->numPieces ? row->pieces[k].start : newline;
+            size_t len = k < row->numPieces ? (size_t)row->pieces[k].len : 1;
+            struct iovec *last = job->count ? &job->slices[job->count - 1] : NULL;
+            const char *end = last ? (const char *)last->iov_base + last->iov_len : NULL;
+            if (len == 0)
+                continue;
+            job->len += len;
+            if (last && (end == s || (s == newline && orig && end >= orig && end < origEnd &&
+                                      *end == '\n')))
+            {
+                last->iov_len += len;
+                continue;
+            }
+            if (job->count == job->cap)
+            {
+                job->cap = job->cap ? job->cap * 2 : 1024;
+                job->slices = realloc(job->slices, sizeof(struct iovec) * job->cap);
+                if (job->slices == NULL)
+                    die("realloc");
+            }
+            job->slices[job->count].iov_base = (void *)s;
+            job->slices[job->count++].iov_len = len;
+        }
+    }
+}
+
+// Writes the job's slices to fd in batches of at most EDITOR_SAVE_IOV slices
+// and EDITOR_SAVE_CHUNK bytes.
+int editorSaveWrite(const editorSaveJob *job, int fd)
+{
+    struct iovec iov[EDITOR_SAVE_IOV];
+    int n = 0;
+    size_t batch = 0;
+    for (int j = 0; j < job->count; j++)
+    {
+        const char *s = job->slices[j].iov_base;
+        size_t left = job->slices[j].iov_len;
+        while (left > 0)
+        {
+            size_t take = left < EDITOR_SAVE_CHUNK - batch ? left : EDITOR_SAVE_CHUNK - batch;
+            iov[n].iov_base = (void *)s;
+            iov[n++].iov_len = take;
+            s += take;
+            left -= take;
+            batch += take;
+            if (n == EDITOR_SAVE_IOV || batch == EDITOR_SAVE_CHUNK)
+            {
+                if (editorWriteAll(fd, iov, n) == -1)
+                    return -1;
+                n = 0;
+                batch = 0;
+            }
+        }
+    }
+    return editorWriteAll(fd, iov, n);
+}
+
+double editorElapsedMs(const struct timespec *since)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1e3 + (now.tv_nsec - since->tv_nsec) / 1e6;
+}
+
+// Writes the job over its file itself. Returns 0, or -1 with errno set.
+int editorSaveInPlace(editorSaveJob *job)
+{
+    if (textDetachOrig() == -1)
+        return -1;
+    int fd = open(job->filename, O_RDWR | O_CREAT, 0644);
+    if (fd == -1)
+        return -1;
+    int ok = editorSaveWrite(job, fd) != -1 && ftruncate(fd, job->len) != -1;
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    ok = ok && fsync(fd) != -1;
+    job->syncMs = editorElapsedMs(&t);
+    int err = errno;
+    close(fd);
+    errno = err;
+    return ok ? 0 : -1;
+}
+
+// Writes the rows to a hidden temp file next to `path`, syncs it, renames it
+// over `path` and syncs the directory, so a crash or a full disk leaves
+// either the old file or the new one, never a mix. The temp file takes the
+// old file's mode and owner. A symlink is saved through to its target.
+// The mapped original is the old inode, which stays readable after the
+// rename. Returns 0, -1 with errno set, or 1 if the file cannot be replaced
+// this way (no temp file can be made beside it, or it has other hard
+// links) and must be written in place.
+int editorSaveAtomic(editorSaveJob *job)
+{
+    char *target = realpath(job->filename, NULL);
+    if (target == NULL && errno != ENOENT)
+        return -1;
+    if (target == NULL)
+        target = strdup(job->filename);
+
+    struct stat st;
+    int exists = stat(target, &st) == 0;
+    if (exists && st.st_nlink > 1)
+    {
+        free(target);
+        return 1;
+    }
+
+    char *slash = strrchr(target, '/');
+    const char *base = slash ? slash + 1 : target;
+    int dirLen = slash ? slash - target : 1;
+    char *dir = strndup(slash ? target : ".", dirLen ? dirLen : 1);
+    size_t tmpLen = strlen(dir) + strlen(base) + 10;
+    char *tmp = malloc(tmpLen);
+    snprintf(tmp, tmpLen, "%s/.%s.XXXXXX", dir, base);
+
+    int fd = mkstemp(tmp);
+    if (fd == -1)
+    {
+        free(tmp);
+        free(dir);
+        free(target);
+        return 1;
+    }
+    if (exists)
+    {
+        // Without the old owner, set-id bits would apply to the wrong user.
+        int owned = fchown(fd, st.st_uid, st.st_gid) != -1;
+        fchmod(fd, st.st_mode & (owned ? 07777 : 0777));
+    }
+    else
+    {
+        fchmod(fd, 0644 & ~E.umask);
+    }
+
+    struct timespec t;
+    int ok = editorSaveWrite(job, fd) != -1;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    ok = ok && fsync(fd) != -1;
+    job->syncMs = editorElapsedMs(&t);
+    ok = close(fd) != -1 && ok;
+    ok = ok && rename(tmp, target) != -1;
+    int err = errno;
+    if (ok)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &t);
+        int dfd = open(dir, O_RDONLY | O_DIRECTORY);
+        if (dfd != -1)
+        {
+            fsync(dfd);
+            close(dfd);
+        }
+        job->dirMs = editorElapsedMs(&t);
+    }
+    else
+        unlink(tmp);
+
+    free(tmp);
+    free(dir);
+    free(target);
+    errno = err;
+    return ok ? 0 : -1;
+}
+
+void *editorSaveRun(void *arg)
+{
+    editorSaveJob *job = arg;
+    struct timespec t0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    job->syncMs = 0;
+    job->dirMs = 0;
+    int r = EDITOR_ATOMIC_SAVE ? editorSaveAtomic(job) : 1;
+    if (r == 1)
+        r = editorSaveInPlace(job);
+    int err = errno;
+
+    pthread_mutex_lock(&E.lock);
+    job->ms = editorElapsedMs(&t0);
+    job->result = r;
+    job->err = err;
+    job->done = 1;
+    pthread_mutex_unlock(&E.lock);
+    return NULL;
+}
+
+// Reports a finished save. Edits made while it ran keep the buffer dirty.
+void editorSaveFinish()
+{
+    editorSaveJob *job = &E.save;
+    if (job->result == 0)
+    {
+        editorSetStatusMessage("%lld bytes written to disk in %.1f ms (%.0f MB/s, fsync %.1f+%.1f ms)",
+                               job->len, job->ms, job->ms > 0 ? job->len / job->ms / 1e3 : 0,
+                               job->syncMs, job->dirMs);
+        E.dirty -= job->dirty;
+        journalRebase(job->journalSize);
+    }
+    else
+        editorSetStatusMessage("Can't save! I/O error: %s", strerror(job->err));
+    free(job->filename);
+    job->filename = NULL;
+    job->running = 0;
+    job->done = 0;
+}
+
+// Blocks until a save in flight is finished.
+void editorSaveWait()
+{
+    if (!E.save.running)
+        return;
+    pthread_mutex_unlock(&E.lock);
+    pthread_join(E.save.thread, NULL);
+    pthread_mutex_lock(&E.lock);
+    editorSaveFinish();
+}
+
+// Snapshots the rows and hands them to a writer thread, so a slow disk
+// does not hold up the editor.
+void editorSave()
+{
+    if (E.filename == NULL)
+    {
+        E.filename = editorPrompt("Save as: %s", 0, NULL);
+        if (E.filename == NULL)
+        {
+            editorSetStatusMessage("Save aborted");
+            return;
+        }
+        editorSelectSyntaxHighlight();
+    }
+    editorSaveJob *job = &E.save;
+    if (job->running)
+    {
+        editorSetStatusMessage("Still saving...");
+        return;
+    }
+
+    editorSaveSnapshot(job);
+    journalWrite();
+    job->journalSize = E.journal.fd != -1 ? E.journal.size : (long long)sizeof(journalHeader);
+    job->filename = strdup(E.filename);
+    job->dirty = E.dirty;
+    job->running = 1;
+    job->done = 0;
+    editorSetStatusMessage("Saving %.1f MB...", job->len / 1e6);
+    if (pthread_create(&job->thread, NULL, editorSaveRun, job) != 0)
+    {
+        pthread_mutex_unlock(&E.lock);
+        editorSaveRun(job);
+        pthread_mutex_lock(&E.lock);
+        editorSaveFinish();
+    }
+}
+
+// Journal
+
+char *journalPathFor(const char *filename)
+{
+    const char *slash = strrchr(filename, '/');
+    int dirLen = slash ? slash - filename + 1 : 0;
+    size_t len = strlen(filename) + 10;
+    char *path = malloc(len);
+    if (path == NULL)
+        die("malloc");
+    snprintf(path, len, "%.*s.%s.journal", dirLen, filename, filename + dirLen);
+    return path;
+}
+
+// Names the version of the file described by `st`; a journal written
+// against any other version is not replayed.
+void journalBaseFrom(journalHeader *h, const struct stat *st)
+{
+    memset(h, 0, sizeof(journalHeader));
+    memcpy(h->magic, EDITOR_JOURNAL_MAGIC, sizeof(h->magic));
+    h->dev = st->st_dev;
+    h->ino = st->st_ino;
+    h->size = st->st_size;
+    h->mtimeSec = st->st_mtim.tv_sec;
+    h->mtimeNsec = st->st_mtim.tv_nsec;
+}
+
+// FNV-1a over the record after its check field, then the text.
+unsigned int journalCheck(const journalRecord *r, const char *text)
+{
+    const unsigned char *p = (const unsigned char *)r + sizeof(r->check);
+    const unsigned char *end = (const unsigned char *)r + sizeof(journalRecord);
+    unsigned int h = 2166136261u;
+    for (; p < end; p++)
+        h = (h ^ *p) * 16777619u;
+    for (int j = 0; j < r->len; j++)
+        h = (h ^ (unsigned char)text[j]) * 16777619u;
+    return h;
+}
+
+void journalReserve(size_t len)
+{
+    editJournal *jl = &E.journal;
+    if (jl->len + len <= jl->cap)
+        return;
+    size_t cap = jl->cap ? jl->cap : 4096;
+    while (cap < jl->len + len)
+        cap *= 2;
+    char *buf = realloc(jl->buf, cap);
+    if (buf == NULL)
+        die("realloc");
+    jl->buf = buf;
+    jl->cap = cap;
+}
+
+// Stops journaling for the rest of the session; the file on disk is left
+// for recovery.
+void journalFail()
+{
+    editJournal *jl = &E.journal;
+    editorSetStatusMessage("Journal disabled: %s", strerror(errno));
+    if (jl->fd != -1)
+        close(jl->fd);
+    jl->fd = -1;
+    jl->len = 0;
+    jl->failed = 1;
+}
+
+// Starts a journal against the current base, replacing any stale one.
+int journalOpen()
+{
+    editJournal *jl = &E.journal;
+    jl->fd = open(jl->path, O_RDWR | O_APPEND | O_CREAT | O_TRUNC, 0600);
+    if (jl->fd == -1)
+    {
+        journalFail();
+        return -1;
+    }
+    jl->size = 0;
+    journalReserve(sizeof(journalHeader));
+    memcpy(jl->buf + jl->len, &jl->base, sizeof(journalHeader));
+    jl->len += sizeof(journalHeader);
+    return 0;
+}
+
+// Buffers an edit as it is made. The journal file is only created by the
+// first edit, so viewing a file leaves nothing behind.
+void journalAppend(int type, int row, int col, const char *text, int len)
+{
+    editJournal *jl = &E.journal;
+    if (!EDITOR_JOURNAL || jl->replaying || jl->failed || !jl->haveBase)
+        return;
+    if (jl->fd == -1 && journalOpen() == -1)
+        return;
+    journalRecord r = {0, type, row, col, len};
+    r.check = journalCheck(&r, text);
+    journalReserve(sizeof(journalRecord) + len);
+    memcpy(jl->buf + jl->len, &r, sizeof(journalRecord));
+    if (len)
+        memcpy(jl->buf + jl->len + sizeof(journalRecord), text, len);
+    jl->len += sizeof(journalRecord) + len;
+}
+
+// Hands the buffered records to the kernel. From then on they survive the
+// editor or its terminal dying; only a crash of the system can lose them.
+void journalWrite()
+{
+    editJournal *jl = &E.journal;
+    if (jl->fd == -1 || jl->len == 0)
+        return;
+    struct iovec iov = {jl->buf, jl->len};
+    if (editorWriteAll(jl->fd, &iov, 1) == -1)
+    {
+        journalFail();
+        return;
+    }
+    jl->size += jl->len;
+    jl->len = 0;
+    jl->unsynced = 1;
+}
+
+// Group commit: every keypress writes its records, but they are synced at
+// most once per EDITOR_JOURNAL_SYNC_MS while typing goes on, and as soon as
+// it pauses (`force`, from the idle tick).
+void journalCommit(int force)
+{
+    editJournal *jl = &E.journal;
+    journalWrite();
+    if (jl->fd == -1 || !jl->unsynced)
+        return;
+    if (!force && editorElapsedMs(&jl->synced) < EDITOR_JOURNAL_SYNC_MS)
+        return;
+    if (fdatasync(jl->fd) == -1)
+    {
+        journalFail();
+        return;
+    }
+    jl->unsynced = 0;
+    clock_gettime(CLOCK_MONOTONIC, &jl->synced);
+}
+
+// Makes the file just saved the journal's base. Records from offset `keep`
+// on were made after the save's snapshot and apply on top of it, so they
+// move to a fresh journal; if there are none the journal is removed.
+void journalRebase(long long keep)
+{
+    editJournal *jl = &E.journal;
+    struct stat st;
+    if (!EDITOR_JOURNAL || stat(E.filename, &st) == -1)
+        return;
+    journalWrite();
+    journalBaseFrom(&jl->base, &st);
+    jl->haveBase = 1;
+    if (jl->path == NULL)
+        jl->path = journalPathFor(E.filename);
+    if (jl->fd == -1)
+        return;
+    if (keep >= jl->size)
+    {
+        close(jl->fd);
+        unlink(jl->path);
+        jl->fd = -1;
+        jl->unsynced = 0;
+        return;
+    }
+
+    size_t tailLen = jl->size - keep;
+    char *tail = malloc(tailLen);
+    size_t tmpLen = strlen(jl->path) + 5;
+    char *tmp = malloc(tmpLen);
+    if (tail == NULL || tmp == NULL)
+        die("malloc");
+    snprintf(tmp, tmpLen, "%s.new", jl->path);
+    int fd = open(tmp, O_RDWR | O_APPEND | O_CREAT | O_TRUNC, 0600);
+    size_t got = 0;
+    while (fd != -1 && got < tailLen)
+    {
+        ssize_t n = pread(jl->fd, tail + got, tailLen - got, keep + got);
+        if (n <= 0 && !(n == -1 && errno == EINTR))
+            break;
+        if (n > 0)
+            got += n;
+    }
+    struct iovec iov[2] = {{&jl->base, sizeof(journalHeader)}, {tail, tailLen}};
+    int ok = fd != -1 && got == tailLen && editorWriteAll(fd, iov, 2) != -1 &&
+             fdatasync(fd) != -1 && rename(tmp, jl->path) != -1;
+    int err = errno;
+    free(tail);
+    if (!ok)
+    {
+        if (fd != -1)
+        {
+            close(fd);
+            unlink(tmp);
+        }
+        free(tmp);
+        errno = err;
+        journalFail();
+        return;
+    }
+    free(tmp);
+    close(jl->fd);
+    jl->fd = fd;
+    jl->size = sizeof(journalHeader) + tailLen;
+    jl->unsynced = 0;
+    clock_gettime(CLOCK_MONOTONIC, &jl->synced);
+}
+
+// Whether a replayed record fits the rows as they are.
+int journalFits(const journalRecord *r)
+{
+    if (r->type < UNDO_INSERT || r->type > UNDO_DEL_ROW || r->row < 0 || r->col < 0)
+        return 0;
+    if (r->type == UNDO_ADD_ROW)
+        return r->row <= E.numRows;
+    if (r->row >= E.numRows)
+        return 0;
+    int size = editorRowAt(r->row)->size;
+    switch (r->type)
+    {
+    case UNDO_INSERT:
+    case UNDO_SPLIT:
+        return r->col <= size;
+    case UNDO_DELETE:
+        return r->col <= size - r->len;
+    case UNDO_JOIN:
+        return r->row + 1 < E.numRows;
+    }
+    return 1;
+}
+
+// Replays the journal an editor left behind when it died before saving, if
+// it was written against this very version of the file. Replay stops at
+// the first record that is torn or does not fit, and journaling carries on
+// after the last good one. The recovered edits are unsaved, not undoable.
+void journalRecover(const struct stat *st)
+{
+    editJournal *jl = &E.journal;
+    if (!EDITOR_JOURNAL)
+        return;
+    journalBaseFrom(&jl->base, st);
+    jl->haveBase = 1;
+    free(jl->path);
+    jl->path = journalPathFor(E.filename);
+    int fd = open(jl->path, O_RDWR | O_APPEND);
+    if (fd == -1)
+        return;
+
+    struct stat js;
+    journalHeader h;
+    if (fstat(fd, &js) == -1 || js.st_size < (off_t)sizeof(journalHeader) ||
+        pread(fd, &h, sizeof(journalHeader), 0) != sizeof(journalHeader) ||
+        memcmp(&h, &jl->base, sizeof(journalHeader)) != 0)
+    {
+        close(fd);
+        editorSetStatusMessage("Not replaying %s: the file has changed since", jl->path);
+        return;
+    }
+    size_t n = js.st_size - sizeof(journalHeader);
+    char *data = malloc(n ? n : 1);
+    if (data == NULL)
+        die("malloc");
+    size_t got = 0;
+    while (got < n)
+    {
+        ssize_t r = pread(fd, data + got, n - got, sizeof(journalHeader) + got);
+        if (r <= 0 && !(r == -1 && errno == EINTR))
+            break;
+        if (r > 0)
+            got += r;
+    }
+
+    size_t off = 0;
+    int applied = 0;
+    jl->replaying = 1;
+    while (off + sizeof(journalRecord) <= got)
+    {
+        journalRecord r;
+        memcpy(&r, data + off, sizeof(journalRecord));
+        const char *text = data + off + sizeof(journalRecord);
+        if (r.len < 0 || (size_t)r.len > got - off - sizeof(journalRecord) ||
+            r.check != journalCheck(&r, text) || !journalFits(&r))
+            break;
+        undoRecord u = {r.type, 0, r.row, r.col, r.len, 0};
+        undoApply(&u, text, 0);
+        off += sizeof(journalRecord) + r.len;
+        applied++;
+    }
+    jl->replaying = 0;
+    free(data);
+
+    if (applied == 0)
+    {
+        close(fd);
+        unlink(jl->path);
+        return;
+    }
+    jl->fd = fd;
+    jl->size = sizeof(journalHeader) + off;
+    if (ftruncate(fd, jl->size) == -1)
+    {
+        journalFail();
+        return;
+    }
+    editorSetStatusMessage("Recovered %d edits from %s (unsaved)", applied, jl->path);
+}
+
+// Ends the session's journal: quitting keeps or discards the edits on
+// purpose, so nothing is left to recover.
+void journalClose()
+{
+    editJournal *jl = &E.journal;
+    if (jl->fd != -1)
+    {
+        close(jl->fd);
+        unlink(jl->path);
+    }
+    jl->fd = -1;
+    free(jl->buf);
+    free(jl->path);
+}
+
+void editorOpen(char *fileName)
+{
+    free(E.filename);
+    E.filename = strdup(fileName);
+    editorSelectSyntaxHighlight();
+
+    int fd = open(fileName, O_RDONLY);
+    if (fd == -1)
+        die("open");
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+        die("fstat");
+
+    if (!S_ISREG(st.st_mode) || textMapFile(fd, st.st_size) == -1)
+        textReadFile(fd, st.st_size);
+    close(fd);
+
+    E.dirty = 0;
+    if (E.text.origMapped && (long long)E.text.origLen >= EDITOR_PAGE_THRESHOLD)
+    {
+        pageOpen();
+        return;
+    }
+    lineIndexBuild();
+    if (S_ISREG(st.st_mode))
+        journalRecover(&st);
+}
+
+// Append Buffer
+
+// Grows geometrically and hands back room for `len` bytes, so callers can
+// fill a run in place instead of appending it byte by byte.
+char *abReserve(aBuf *ab, int len)
+{
+    if (ab->len + len > ab->cap)
+    {
+        int cap = ab->cap ? ab->cap : AB_INITIAL_CAP;
+        while (cap < ab->len + len)
+            cap *= 2;
+        char *new = realloc(ab->b, cap);
+        if (new == NULL)
+            return NULL;
+        ab->b = new;
+        ab->cap = cap;
+    }
+    char *p = &ab->b[ab->len];
+    ab->len += len;
+    return p;
+}
+
+void abAppend(aBuf *ab, const char *s, int len)
+{
+    char *p = abReserve(ab, len);
+    if (p == NULL)
+        return;
+    memcpy(p, s, len);
+}
+
+void abFree(aBuf *ab)
+{
+    free(ab->b);
+    ab->b = NULL;
+    ab->len = 0;
+    ab->cap = 0;
+}
+
+// Terminal
+
+void die(const char *s)
+{
+    write(STDOUT_FILENO, "\x1b[2J", 4);
+    write(STDOUT_FILENO, "\x1b[H", 3);
+    perror(s);
+    exit(EXIT_FAILURE);
+}
+
+void disableRawMode()
+{
+    if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) == -1)
+        die("tcsetattr");
+}
+
+void enableRawMode()
+{
+    if (tcgetattr(STDIN_FILENO, &E.orig_termios) == -1)
+        die("tcgetattr");
+
+    atexit(disableRawMode);
+
+    struct termios raw = E.orig_termios;
+    raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+    raw.c_oflag &= ~(OPOST);
+    raw.c_cflag |= (CS8);
+    raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+    raw.c_cc[VMIN] = 0;
+    raw.c_cc[VTIME] = 1;
+    if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1)
+        die("tcsetattr");
+}
+
+// Reads one byte with the editor lock released, so the highlight worker can
+// run while we wait for input.
+ssize_t editorReadInput(char *c)
+{
+    pthread_mutex_unlock(&E.lock);
+    ssize_t n = read(STDIN_FILENO, c, 1);
+    pthread_mutex_lock(&E.lock);
+    return n;
+}
+
+int editorReadKey()
+{
+    int nread;
+    char c;
+    while ((nread = editorReadInput(&c)) != 1)
+    {
+        if (nread == -1 && errno != EAGAIN)
+            die("read");
+        if (nread == 0)
+            editorIdle();
+    }
+    if (c == '\x1b')
+    {
+        char seq[3];
+        if (editorReadInput(&seq[0]) != 1)
+            return '\x1b';
+        if (editorReadInput(&seq[1]) != 1)
+            return '\x1b';
+        if (seq[0] == '[')
+        {
+            if (seq[1] >= '0' && seq[1] <= '9')
+            {
+                if (editorReadInput(&seq[2]) != 1)
+                    return '\x1b';
+                if (seq[2] == '~')
+                {
+                    switch (seq[1])
+                    {
+                    case '5':
+                        return PAGE_UP;
+                    case '6':
+                        return PAGE_DOWN;
+                    case '1':
+                    case '7':
+                        return HOME_KEY;
+                    case '4':
+                    case '8':
+                        return END_KEY;
+                    case '3':
+                        return DELETE_KEY;
+                    }
+                }
+            }
+            else
+            {
+                switch (seq[1])
+                {
+                case 'A':
+                    return ARROW_UP;
+                case 'B':
+                    return ARROW_DOWN;
+                case 'C':
+                    return ARROW_RIGHT;
+                case 'D':
+                    return ARROW_LEFT;
+                case 'H':
+                    return HOME_KEY;
+                case 'F':
+                    return END_KEY;
+                }
+            }
+        }
+        else if (seq[0] == 'O')
+        {
+            switch (seq[1])
+            {
+            case 'H':
+                return HOME_KEY;
+            case 'F':
+                return END_KEY;
+            }
+        }
+        return '\x1b';
+    }
+    else
+    {
+        return c;
+    }
+}
+
+int getCursorPosition(int *rows, int *cols)
+{
+    char buf[32];
+    unsigned int i = 0;
+
+    if (write(STDOUT_FILENO, "\x1b[6n", 4) != 4)
+        return -1;
+    while (i < sizeof(buf) - 1)
+    {
+        if (read(STDIN_FILENO, &buf[i], 1) != 1)
+            break;
+        if (buf[i] == 'R')
+            break;
+        i++;
+    }
+    buf[i] = '\0';
+    if (buf[0] != '\x1b' || buf[1] != '[')
+        return -1;
+    if (sscanf(&buf[2], "%d;%d", rows, cols) != 2)
+        return -1;
+    return 0;
+}
+
+int getWindowSize(int *rows, int *cols)
+{
+    struct winsize ws;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0)
+    {
+        if (write(STDOUT_FILENO, "\x1b[999C\x1b[999B", 12) != 12)
+            return -1;
+        return getCursorPosition(rows, cols);
+    }
+    else
+    {
+        *cols = ws.ws_col;
+        *rows = ws.ws_row;
+        return 0;
+    }
+}
+
+// Input
+
+// Reads a line on the message bar. Enter on an empty line is ignored unless
+// `allowEmpty` is set.
+char *editorPrompt(char *prompt, int allowEmpty, void (*callback)(char *, int))
+{
+    size_t bufsize = 128;
+    char *buf = malloc(bufsize);
+    size_t buflen = 0;
+    buf[0] = '\0';
+    while (1)
+    {
+        editorSetStatusMessage(prompt, buf);
+        editorRefreshScreen();
+        int c = editorReadKey();
+        if (c == DELETE_KEY || c == CTRL_KEY('h') || c == BACKSPACE)
+        {
+            if (buflen != 0)
+                buf[--buflen] = '\0';
+        }
+        else if (c == '\x1b')
+        {
+            editorSetStatusMessage("");
+            if (callback)
+                callback(buf, c);
+            free(buf);
+            return NULL;
+        }
+        else if (c == '\r')
+        {
+            if (buflen != 0 || allowEmpty)
+            {
+                editorSetStatusMessage("");
+                if (callback)
+                    callback(buf, c);
+                return buf;
+            }
+        }
+        else if (!iscntrl(c) && c < 128)
+        {
+            if (buflen == bufsize - 1)
+            {
+                bufsize *= 2;
+                buf = realloc(buf, bufsize);
+            }
+            buf[buflen++] = c;
+            buf[buflen] = '\0';
+        }
+        if (callback)
+            callback(buf, c);
+    }
+}
+
+void editorMoveCursor(int key)
+{
+
+    editorRow *row = (E.cy >= E.numRows) ? NULL : editorRowAt(E.cy);
+
+    switch (key)
+    {
+    case ARROW_LEFT:
+        if (E.cx != 0)
+            E.cx--;
+        else if (E.cy > 0)
+        {
+            E.cy--;
+            E.cx = editorRowAt(E.cy)->size - 1;
+        }
+        break;
+    case ARROW_RIGHT:
+        if (row && E.cx < row->size)
+            E.cx++;
+        else if (row && E.cx == row->size)
+        {
+            E.cy++;
+            E.cx = 0;
+        }
+        break;
+    case ARROW_UP:
+        if (E.cy != 0)
+            E.cy--;
+        break;
+    case ARROW_DOWN:
+        if (E.cy < E.numRows - 1)
+            E.cy++;
+        break;
+    }
+
+    row = (E.cy >= E.numRows) ? NULL : editorRowAt(E.cy);
+    int rowLen = row ? row->size : 0;
+    if (E.cx > rowLen)
+        E.cx = rowLen;
+}
+
+void editorGotoLine()
+{
+    char *query = editorPrompt("Go to line: %s (ESC to cancel)", 0, NULL);
+    if (query == NULL)
+        return;
+    long long line = atoll(query) - 1;
+    free(query);
+    if (line < 0)
+        line = 0;
+    if (E.page.active)
+        pageGoto(line);
+    else
+        E.cy = line < E.numRows ? line : (E.numRows ? E.numRows - 1 : 0);
+    E.cx = 0;
+    E.rowOff = E.cy > E.screenRows / 2 ? E.cy - E.screenRows / 2 : 0;
+}
+
+void editorProcessKeypress()
+{
+    static int quitTimes = EDITOR_QUIT_TIMES;
+    int c = editorReadKey();
+    E.undo.group++;
+    switch (c)
+    {
+    case '\r':
+        if (!editorReadOnly())
+            editorInsertNewline();
+        break;
+    case BACKSPACE:
+    case CTRL_KEY('h'):
+    case DELETE_KEY:
+        if (editorReadOnly())
+            break;
+        if (c == DELETE_KEY)
+            editorMoveCursor(ARROW_RIGHT);
+        editorDelChar();
+        break;
+    case CTRL_KEY('s'):
+        if (E.dirty)
+            editorSave();
+        break;
+    case CTRL_KEY('f'):
+        editorFind();
+        break;
+    case CTRL_KEY('g'):
+        editorGotoLine();
+        break;
+    case CTRL_KEY('r'):
+        if (!editorReadOnly())
+            editorReplace();
+        break;
+    case CTRL_KEY('z'):
+        if (!editorReadOnly())
+            editorUndo();
+        break;
+    case CTRL_KEY('y'):
+        if (!editorReadOnly())
+            editorRedo();
+        break;
+
+    case ARROW_DOWN:
+    case ARROW_LEFT:
+    case ARROW_RIGHT:
+    case ARROW_UP:
+        editorMoveCursor(c);
+        break;
+    case PAGE_UP:
+    case PAGE_DOWN:
+        if (E.page.active)
+            pageScroll(c == PAGE_UP ? -E.screenRows : E.screenRows);
+        else if (c == PAGE_UP)
+            E.cy = 0;
+        else if (E.cy < E.numRows)
+            E.cy = E.numRows - 1;
+        if (E.cy < E.numRows && E.cx > editorRowAt(E.cy)->size)
+            E.cx = editorRowAt(E.cy)->size;
+        break;
+    case HOME_KEY:
+        E.cx = 0;
+        break;
+    case END_KEY:
+        E.cx = editorRowAt(E.cy)->size;
+        break;
+    case CTRL_KEY('q'):
+        editorSaveWait();
+        if (E.dirty && quitTimes > 0)
+        {
+            editorSetStatusMessage("File has unsaved changes. "
+                                   "Press Ctrl-Q %d more time to quit.",
+                                   quitTimes);
+            quitTimes--;
+            return;
+        }
+        write(STDOUT_FILENO, "\x1b[2J", 4);
+        write(STDOUT_FILENO, "\x1b[H", 3);
+        editorStopHlWorker();
+        pageClose();
+        journalClose();
+        free(E.save.slices);
+        slabRelease();
+        free(E.rows);
+        textFree();
+        abFree(&E.frame);
+        free(E.undo.buf);
+        free(E.edit.marks);
+        free(E.filename);
+
+        exit(EXIT_SUCCESS);
+        break;
+    case CTRL_KEY('l'):
+    case '\x1b':
+        break;
+    default:
+        if (!iscntrl(c) && !editorReadOnly())
+            editorInsertChar(c);
+        break;
+    }
+
+    if (E.edit.row != E.cy)
+        lineGapFlush();
+    journalCommit(0);
+    pageFollow();
+    quitTimes = EDITOR_QUIT_TIMES;
+}
+
+// Syntax highlighting
+
+int is_separator(int c)
+{
+    return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+}
+
+unsigned int hlKeywordHash(const char *s, int len)
+{
+    unsigned int h = 2166136261u ^ len;
+    for (int j = 0; j < len; j++)
+        h = (h ^ (unsigned char)s[j]) * 16777619u;
+    return h;
+}
+
+// Compiles a syntax's keyword list once into an open-addressed hash with
+// the KEYWORD1/KEYWORD2 class resolved, plus a bitmap of the lengths that
+// occur so most identifiers are rejected before hashing.
+void hlCompileKeywords(editorSyntax *syntax)
+{
+    if (syntax->keywordTable || syntax->keywords == NULL)
+        return;
+    hlKeywordTable *table = calloc(1, sizeof(hlKeywordTable));
+    if (table == NULL)
+        die("calloc");
+    int n = 0;
+    while (syntax->keywords[n])
+        n++;
+    unsigned int size = 8;
+    while (size < (unsigned int)n * 2)
+        size *= 2;
+    table->slots = calloc(size, sizeof(hlKeyword));
+    if (table->slots == NULL)
+        die("calloc");
+    table->mask = size - 1;
+
+    for (int j = 0; j < n; j++)
+    {
+        const char *word = syntax->keywords[j];
+        int len = strlen(word);
+        unsigned char hl = HL_KEYWORD1;
+        if (len && word[len - 1] == '|')
+        {
+            hl = HL_KEYWORD2;
+            len--;
+        }
+        if (len == 0 || len >= HL_KEYWORD_MAX_LEN)
+            continue;
+        unsigned int slot = hlKeywordHash(word, len) & table->mask;
+        while (table->slots[slot].len &&
+               !(table->slots[slot].len == len && !memcmp(table->slots[slot].word, word, len)))
+            slot = (slot + 1) & table->mask;
+        if (table->slots[slot].len)
+            continue;
+        table->slots[slot].word = word;
+        table->slots[slot].len = len;
+        table->slots[slot].hl = hl;
+        table->lengths |= 1ull << len;
+    }
+    syntax->keywordTable = table;
+}
+
+// Returns the keyword class of the token s[0..len), or HL_NORMAL.
+int hlKeywordLookup(const hlKeywordTable *table, const char *s, int len)
+{
+    if (len >= HL_KEYWORD_MAX_LEN || !(table->lengths & (1ull << len)))
+        return HL_NORMAL;
+    unsigned int slot = hlKeywordHash(s, len) & table->mask;
+    while (table->slots[slot].len)
+    {
+        if (table->slots[slot].len == len && !memcmp(table->slots[slot].word, s, len))
+            return table->slots[slot].hl;
+        slot = (slot + 1) & table->mask;
+    }
+    return HL_NORMAL;
+}
+
+int editorSyntaxToColor(int hl)
+{
+    switch (hl)
+    {
+    case HL_KEYWORD1:
+        return 33;
+    case HL_KEYWORD2:
+        return 32;
+    case HL_COMMENT:
+    case HL_ML_COMMENT:
+        return 36;
+    case HL_STRING:
+        return 35;
+    case HL_NUMBER:
+        return 31;
+    case HL_MATCH:
+        return 34;
+    default:
+        return 37;
+    }
+}
+
+void editorUpdateSyntax(editorRow *row)
+{
+    editorUpdateSyntaxFrom(row, 0, row->hlStateIn | HL_STATE_PREV_SEP, NULL, 0, row->rsize);
+}
+
+// Lexes render from column `at`, where the lexer is in `state`, to the end of
+// the row, recording the state found at each mark. Once past column `resync`,
+// arriving at a mark in the state it already holds means the rest of the row
+// lexes as before, so it stops there.
+void editorUpdateSyntaxFrom(editorRow *row, int at, int state, renderMark *marks, int numMarks,
+                            int resync)
+{
+    if (E.syntax == NULL)
+    {
+        memset(row->hl + at, HL_NORMAL, row->rsize - at);
+        return;
+    }
+
+    const hlKeywordTable *keywords = E.syntax->keywordTable;
+
+    char *comment = E.syntax->singlelineCommentStart;
+    char *mlCommentStart = E.syntax->multilineCommentStart;
+    char *mlCommentEnd = E.syntax->multilineCommentEnd;
+
+    int commentLen = comment ? strlen(comment) : 0;
+    int mlCommentStartLen = mlCommentStart ? strlen(mlCommentStart) : 0;
+    int mlCommentEndLen = mlCommentEnd ? strlen(mlCommentEnd) : 0;
+
+    int prevSep = state & HL_STATE_PREV_SEP;
+    int inString = state >> HL_STATE_STRING_SHIFT;
+    int inComment = state & HL_STATE_ML_COMMENT;
+    int continued = 0;
+
+    int mk = 0;
+    while (mk < numMarks && marks[mk].rx < at)
+        mk++;
+
+    int i = at;
+    while (i < row->rsize)
+    {
+        char c = row->render[i];
+        unsigned char prevHL = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
+
+        for (; mk < numMarks && marks[mk].rx <= i; mk++)
+        {
+            int here = HL_STATE_UNKNOWN;
+            if (marks[mk].rx == i)
+                here = inString << HL_STATE_STRING_SHIFT | (inComment ? HL_STATE_ML_COMMENT : 0) |
+                       (prevSep ? HL_STATE_PREV_SEP : 0) |
+                       (prevHL == HL_NUMBER ? HL_STATE_PREV_NUMBER : 0);
+            if (i >= resync && here != HL_STATE_UNKNOWN && here == marks[mk].hlState)
+                return;
+            marks[mk].hlState = here;
+        }
+
+        // highlight comments
+        if (commentLen && !inString && !inComment)
+        {
+            if (!strncmp(&row->render[i], comment, commentLen))
+            {
+                memset(&row->hl[i], HL_COMMENT, row->rsize - i);
+                break;
+            }
+        }
+
+        if (mlCommentStartLen && mlCommentEndLen && !inString)
+        {
+            if (inComment)
+            {
+                row->hl[i] = HL_ML_COMMENT;
+                if (!strncmp(&row->render[i], mlCommentEnd, mlCommentEndLen))
+                {
+                    memset(&row->hl[i], HL_ML_COMMENT, mlCommentEndLen);
+                    i += mlCommentEndLen;
+                    inComment = 0;
+                    prevSep = 1;
+                    continue;
+                }
+                else
+                {
+                    i++;
+                    continue;
+                }
+            }
+            else if (!strncmp(&row->render[i], mlCommentStart, mlCommentStartLen))
+            {
+                memset(&row->hl[i], HL_ML_COMMENT, mlCommentStartLen);
+                i += mlCommentStartLen;
+                inComment = 1;
+                continue;
+            }
+        }
+
+        // highlight strings
+        if (E.syntax->flags & HL_HIGHLIGHT_STRINGS)
+        {
+            if (inString)
+            {
+                row->hl[i] = HL_STRING;
+                if (c == '\\' && i + 1 == row->rsize)
+                    continued = 1;
+                if (c == '\\' && i + 1 < row->rsize)
+                {
+                    row->hl[i + 1] = HL_STRING;
+                    i += 2;
+                    continue;
+                }
+                if (c == inString)
+                    inString = 0;
+                i++;
+                prevSep = 1;
+                continue;
+            }
+            else if (c == '"' || c == '\'')
+            {
+                inString = c;
+                row->hl[i] = HL_STRING;
+                i++;
+                continue;
+            }
+        }
+
+        // highlight numbers
+        if (E.syntax->flags & HL_HIGHLIGHT_NUMBERS)
+        {
+            if ((isdigit(c) && (prevSep || prevHL == HL_NUMBER)) ||
+                (c == '.' && prevHL == HL_NUMBER))
+            {
+                row->hl[i] = HL_NUMBER;
+                i++;
+                prevSep = 0;
+                continue;
+            }
+        }
+
+        // highlight keywords
+        if (prevSep && keywords)
+        {
+            int klen = 0;
+            while (!is_separator(row->render[i + klen]))
+                klen++;
+            int kw = klen ? hlKeywordLookup(keywords, &row->render[i], klen) : HL_NORMAL;
+            if (kw != HL_NORMAL)
+            {
+                memset(&row->hl[i], kw, klen);
+                i += klen;
+                prevSep = 0;
+                continue;
+            }
+        }
+
+        row->hl[i] = HL_NORMAL;
+        prevSep = is_separator(c);
+        i++;
+    }
+    for (; mk < numMarks; mk++)
+        marks[mk].hlState = HL_STATE_UNKNOWN;
+
+    // A string only carries over when a trailing backslash continues it.
+    row->hlStateOut = (inComment ? HL_STATE_ML_COMMENT : 0) |
+                      (continued ? inString << HL_STATE_STRING_SHIFT : 0);
+}
+
+void editorSelectSyntaxHighlight()
+{
+    E.syntax = NULL;
+    if (!E.filename)
+        return;
+    char *ext = strrchr(E.filename, '.');
+    for (unsigned int j = 0; j < HLDB_ENTRIES; j++)
+    {
+        editorSyntax *s = &HLDB[j];
+        unsigned int i = 0;
+        while (s->fileMatch[i])
+        {
+            int is_ext = (s->fileMatch[i][0] == '.');
+            if ((is_ext && ext && !strcmp(ext, s->fileMatch[i])) ||
+                (!is_ext && strstr(E.filename, s->fileMatch[i])))
+            {
+                E.syntax = s;
+                hlCompileKeywords(s);
+                int fileRow;
+                for (fileRow = 0; fileRow < E.numRows; fileRow++)
+                    editorRowAt(fileRow)->renderDirty = 1;
+                E.hlValid = 0;
+                E.hlGen++;
+                return;
+            }
+            i++;
+        }
+    }
+}
+
+// Screen buffer
+
+void screenInit(int rows, int cols)
+{
+    E.screen.rows = rows;
+    E.screen.cols = cols;
+    E.screen.cells = calloc(rows * cols, sizeof(screenCell));
+    E.screen.prev = calloc(rows * cols, sizeof(screenCell));
+    if (E.screen.cells == NULL || E.screen.prev == NULL)
+        die("calloc");
+    E.screen.valid = 0;
+    E.screen.rowOff = 0;
+    E.screen.colOff = 0;
+    E.screen.cursorY = -1;
+    E.screen.cursorX = -1;
+    E.screen.pen = 0;
+    E.screen.frameBytes = 0;
+
+    // One escape per highlight class, for each way the reverse-video bit
+    // can change, so runs switch colour without formatting anything.
+    for (int hl = 0; hl < HL_CLASSES; hl++)
+    {
+        int color = hl == HL_NORMAL ? 39 : editorSyntaxToColor(hl);
+        E.screen.penLen[0][hl] = snprintf(E.screen.penSeq[0][hl], sizeof(E.screen.penSeq[0][hl]), "\x1b[%dm", color);
+        E.screen.penLen[1][hl] = snprintf(E.screen.penSeq[1][hl], sizeof(E.screen.penSeq[1][hl]), "\x1b[7;%dm", color);
+        E.screen.penLen[2][hl] = snprintf(E.screen.penSeq[2][hl], sizeof(E.screen.penSeq[2][hl]), "\x1b[27;%dm", color);
+    }
+}
+
+void screenClear()
+{
+    screenCell blank = {' ', 0};
+    for (int j = 0; j < E.screen.rows * E.screen.cols; j++)
+        E.screen.cells[j] = blank;
+}
+
+int screenPut(int y, int x, const char *s, int len, unsigned char attr)
+{
+    if (y < 0 || y >= E.screen.rows)
+        return x;
+    screenCell *row = &E.screen.cells[y * E.screen.cols];
+    for (int j = 0; j < len && x < E.screen.cols; j++, x++)
+    {
+        row[x].ch = s[j];
+        row[x].attr = attr;
+    }
+    return x;
+}
+
+// Like screenPut for row text: control characters are shown as inverse
+// symbols, everything else keeps the run's highlight class.
+void screenPutText(int y, int x, const char *s, int len, unsigned char attr)
+{
+    screenCell *row = &E.screen.cells[y * E.screen.cols];
+    if (len > E.screen.cols - x)
+        len = E.screen.cols - x;
+    for (int j = 0; j < len; j++, x++)
+    {
+        if (iscntrl(s[j]))
+        {
+            row[x].ch = (s[j] <= 26) ? '@' + s[j] : '?';
+            row[x].attr = attr | SCREEN_INVERSE;
+        }
+        else
+        {
+            row[x].ch = s[j];
+            row[x].attr = attr;
+        }
+    }
+}
+
+// Returns the end of the run of equal highlight classes starting at `from`.
+int screenHlRunEnd(const unsigned char *hl, int from, int len)
+{
+    unsigned char h = hl[from];
+    int j = from + 1;
+#ifdef __SSE2__
+    const __m128i v = _mm_set1_epi8((char)h);
+    for (; j + 16 <= len; j += 16)
+    {
+        __m128i block = _mm_loadu_si128((const __m128i *)&hl[j]);
+        unsigned int same = _mm_movemask_epi8(_mm_cmpeq_epi8(block, v));
+        if (same != 0xFFFF)
+            return j + __builtin_ctz(~same);
+    }
+#endif
+    while (j < len && hl[j] == h)
+        j++;
+    return j;
+}
+
+void screenSetPen(aBuf *ab, unsigned char attr)
+{
+    if (E.screen.pen == attr)
+        return;
+    int inverse = attr & SCREEN_INVERSE;
+    int change = 0;
+    if (inverse != (E.screen.pen & SCREEN_INVERSE))
+        change = inverse ? 1 : 2;
+    int hl = attr & ~SCREEN_INVERSE;
+    abAppend(ab, E.screen.penSeq[change][hl], E.screen.penLen[change][hl]);
+    E.screen.pen = attr;
+}
+
+void screenMoveTo(aBuf *ab, int y, int x)
+{
+    if (E.screen.cursorY == y && E.screen.cursorX == x)
+        return;
+    char buf[32];
+    int len;
+    if (E.screen.cursorY == y && E.screen.cursorX >= 0 && x > E.screen.cursorX)
+        len = snprintf(buf, sizeof(buf), "\x1b[%dC", x - E.screen.cursorX);
+    else
+        len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1, x + 1);
+    abAppend(ab, buf, len);
+    E.screen.cursorY = y;
+    E.screen.cursorX = x;
+}
+
+// Writes cells [x, end) of row y, one pen change and one bulk copy per run
+// of equal attributes.
+void screenEmitSpan(aBuf *ab, int y, int x, int end, const screenCell *cells)
+{
+    screenMoveTo(ab, y, x);
+    while (x < end)
+    {
+        int run = x + 1;
+        while (run < end && cells[run].attr == cells[x].attr)
+            run++;
+        screenSetPen(ab, cells[x].attr);
+        char *p = abReserve(ab, run - x);
+        if (p == NULL)
+            return;
+        for (int j = x; j < run; j++)
+            *p++ = cells[j].ch;
+        x = run;
+    }
+    // Writing the last column leaves the cursor in a pending-wrap state.
+    E.screen.cursorX = end < E.screen.cols ? end : -1;
+}
+
+// Shifts what the terminal shows in the text area by `d` lines with a scroll
+// region, so a small rowOff change does not repaint every row.
+void screenScrollText(aBuf *ab, int textRows, int d)
+{
+    char buf[32];
+    int len;
+    screenSetPen(ab, 0);
+    len = snprintf(buf, sizeof(buf), "\x1b[1;%dr\x1b[%d%c\x1b[r", textRows,
+                   d > 0 ? d : -d, d > 0 ? 'S' : 'T');
+    abAppend(ab, buf, len);
+    E.screen.cursorY = -1;
+
+    int cols = E.screen.cols;
+    int n = d > 0 ? d : -d;
+    screenCell *prev = E.screen.prev;
+    if (d > 0)
+        memmove(prev, &prev[n * cols], sizeof(screenCell) * (textRows - n) * cols);
+    else
+        memmove(&prev[n * cols], prev, sizeof(screenCell) * (textRows - n) * cols);
+    screenCell blank = {' ', 0};
+    int from = d > 0 ? textRows - n : 0;
+    for (int j = from * cols; j < (from + n) * cols; j++)
+        prev[j] = blank;
+}
+
+// Emits only the cells that differ from the last frame. Short unchanged gaps
+// are rewritten rather than skipped, and a row whose tail became blank is
+// finished with an erase-to-end-of-line.
+void screenFlush(aBuf *ab)
+{
+    int rows = E.screen.rows;
+    int cols = E.screen.cols;
+    screenCell blank = {' ', 0};
+
+    if (!E.screen.valid)
+    {
+        abAppend(ab, "\x1b[m\x1b[2J", 7);
+        E.screen.pen = 0;
+        E.screen.cursorY = -1;
+        for (int j = 0; j < rows * cols; j++)
+            E.screen.prev[j] = blank;
+        E.screen.valid = 1;
+    }
+
+    for (int y = 0; y < rows; y++)
+    {
+        screenCell *cur = &E.screen.cells[y * cols];
+        screenCell *prev = &E.screen.prev[y * cols];
+        if (!memcmp(cur, prev, sizeof(screenCell) * cols))
+            continue;
+
+        int last = cols - 1;
+        while (last >= 0 && cur[last].ch == ' ' && cur[last].attr == 0)
+            last--;
+
+        int x = 0;
+        while (x < cols)
+        {
+            if (cur[x].ch == prev[x].ch && cur[x].attr == prev[x].attr)
+            {
+                x++;
+                continue;
+            }
+            if (x > last)
+            {
+                screenMoveTo(ab, y, x);
+                screenSetPen(ab, 0);
+                abAppend(ab, "\x1b[K", 3);
+                break;
+            }
+            int end = x + 1;
+            int gap = 0;
+            for (int j = end; j <= last && gap <= SCREEN_GAP; j++)
+            {
+                if (cur[j].ch == prev[j].ch && cur[j].attr == prev[j].attr)
+                {
+                    gap++;
+                }
+                else
                 {
-                    memset(&row->hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
-                    i += klen;
-                    break;
+                    end = j + 1;
+                    gap = 0;
                 }
             }
-            if (keywords[j] != NULL)
+            screenEmitSpan(ab, y, x, end, cur);
+            x = end;
+        }
+    }
+
+    screenSetPen(ab, 0);
+    screenCell *swap = E.screen.prev;
+    E.screen.prev = E.screen.cells;
+    E.screen.cells = swap;
+}
+
+// Output
+
+void editorSetStatusMessage(const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(E.statusMsg, sizeof(E.statusMsg), fmt, ap);
+    va_end(ap);
+    E.statusMsgTime = time(NULL);
+}
+
+void editorDrawMessageBar()
+{
+    int msglen = strlen(E.statusMsg);
+    if (msglen && time(NULL) - E.statusMsgTime < 5)
+        screenPut(E.screenRows + 1, 0, E.statusMsg, msglen, 0);
+}
+
+void editorDrawStatusBar()
+{
+    char status[80], rStatus[80];
+    // In paging mode rows are numbered in the whole file, not the window.
+    long long line = E.cy + 1 + (E.page.active ? E.page.first : 0);
+    long long lines = E.page.active ? E.page.lines : E.numRows;
+    const char *more = E.page.active && !E.page.done ? "+" : "";
+    int len = snprintf(status, sizeof(status), "%.20s - %lld%s lines %s",
+                       E.filename ? E.filename : "[No Name]", lines, more,
+                       E.page.active ? "(read-only)" : E.dirty ? "(modified)" : "");
+
+    int rLen;
+    if (E.search.invalid)
+        rLen = snprintf(rStatus, sizeof(rStatus), "bad regex | %s | %lld/%lld%s",
+                        E.syntax ? E.syntax->fileType : "no ft", line, lines, more);
+    else if (E.search.active)
+        rLen = snprintf(rStatus, sizeof(rStatus), "%s%d/%d matches | %s | %lld/%lld%s",
+                        E.searchRegex ? "regex " : "", E.search.current + 1, E.search.count,
+                        E.syntax ? E.syntax->fileType : "no ft", line, lines, more);
+    else
+        rLen = snprintf(rStatus, sizeof(rStatus), "%s | %lld/%lld%s",
+                        E.syntax ? E.syntax->fileType : "no ft", line, lines, more);
+
+    if (len > E.screenCols)
+        len = E.screenCols;
+
+    int y = E.screenRows;
+    for (int x = 0; x < E.screenCols; x++)
+        screenPut(y, x, " ", 1, SCREEN_INVERSE);
+    screenPut(y, 0, status, len, SCREEN_INVERSE);
+    if (E.screenCols - len >= rLen)
+        screenPut(y, E.screenCols - rLen, rStatus, rLen, SCREEN_INVERSE);
+}
+
+void editorScroll()
+{
+    E.rx = 0;
+    if (E.cy < E.numRows)
+        E.rx = editorRowCxToRx(editorRowAt(E.cy), E.cx);
+
+    if (E.cy < E.rowOff)
+        E.rowOff = E.cy;
+    if (E.cy >= E.rowOff + E.screenRows)
+        E.rowOff = E.cy - E.screenRows + 1;
+
+    if (E.rx < E.colOff)
+        E.colOff = E.rx;
+    if (E.rx >= E.colOff + E.screenCols)
+        E.colOff = E.rx - E.screenCols + 1;
+}
+
+void editorDrawRows()
+{
+    for (int y = 0; y < E.screenRows; y++)
+    {
+        int fileRow = y + E.rowOff;
+        if (fileRow >= E.numRows)
+        {
+
+            if (E.numRows == 0 && y == E.screenRows / 3)
             {
-                prevSep = 0;
-                continue;
+                char welcome[80];
+                int wmLen = snprintf(welcome, sizeof(welcome),
+                                     "Custom Editor -- version %s", EDITOR_VERSION);
+                if (wmLen > E.screenCols)
+                    wmLen = E.screenCols;
+                int padding = (E.screenCols - wmLen) / 2;
+                screenPut(y, 0, "~", 1, 0);
+                screenPut(y, padding, welcome, wmLen, 0);
+            }
+            else
+            {
+                screenPut(y, 0, "~", 1, 0);
+            }
+        }
+        else
+        {
+            editorRowPrepare(fileRow);
+            int len = editorRowAt(fileRow)->rsize - E.colOff;
+            if (len < 0)
+                len = 0;
+            if (len > E.screenCols)
+                len = E.screenCols;
+            char *s = &editorRowAt(fileRow)->render[E.colOff];
+            unsigned char *hl = &editorRowAt(fileRow)->hl[E.colOff];
+            for (int j = 0; j < len;)
+            {
+                int end = screenHlRunEnd(hl, j, len);
+                screenPutText(y, j, &s[j], end - j, hl[j]);
+                j = end;
+            }
+        }
+    }
+
+    int ahead = E.rowOff + E.screenRows + EDITOR_RENDER_LOOKAHEAD;
+    for (int fileRow = E.rowOff + E.screenRows; fileRow < ahead && fileRow < E.numRows; fileRow++)
+        editorRowPrepare(fileRow);
+}
+
+// Runs between keys, whenever a read times out.
+void editorIdle()
+{
+    int redraw;
+    if (E.hlWorker)
+    {
+        redraw = E.hlRedraw;
+        E.hlRedraw = 0;
+    }
+    else
+    {
+        redraw = editorHighlightStep(EDITOR_HL_IDLE_BATCH);
+    }
+    if (E.save.done)
+    {
+        pthread_join(E.save.thread, NULL);
+        editorSaveFinish();
+        redraw = 1;
+    }
+    if (E.page.changed)
+    {
+        E.page.changed = 0;
+        redraw = 1;
+    }
+    journalCommit(1);
+    if (redraw)
+        editorRefreshScreen();
+}
+
+void editorRefreshScreen()
+{
+    E.hlBudget = EDITOR_HL_BUDGET;
+    editorScroll();
+
+    screenClear();
+    editorDrawRows();
+    editorDrawStatusBar();
+    editorDrawMessageBar();
+
+    // The frame buffer keeps its capacity between frames.
+    aBuf *ab = &E.frame;
+    ab->len = 0;
+
+    abAppend(ab, "\x1b[?25l", 6);
+
+    int d = E.rowOff - E.screen.rowOff;
+    if (E.screen.valid && d != 0 && E.colOff == E.screen.colOff &&
+        abs(d) < E.screenRows / 2)
+        screenScrollText(ab, E.screenRows, d);
+    E.screen.rowOff = E.rowOff;
+    E.screen.colOff = E.colOff;
+
+    screenFlush(ab);
+
+    char buf[32];
+    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowOff) + 1, (E.rx - E.colOff) + 1);
+    abAppend(ab, buf, strlen(buf));
+    E.screen.cursorY = E.cy - E.rowOff;
+    E.screen.cursorX = E.rx - E.colOff;
+
+    abAppend(ab, "\x1b[?25h", 6);
+
+    write(STDOUT_FILENO, ab->b, ab->len);
+    E.screen.frameBytes = ab->len;
+
+    if (E.hlWorker && E.hlValid < E.numRows)
+        pthread_cond_signal(&E.hlCond);
+}
+
+// Regular expressions
+
+void regexSetAdd(unsigned char *set, int c)
+{
+    set[(unsigned char)c >> 3] |= 1 << ((unsigned char)c & 7);
+}
+
+int regexSetHas(const unsigned char *set, int c)
+{
+    return set[(unsigned char)c >> 3] & (1 << ((unsigned char)c & 7));
+}
+
+int regexAddState(regexProg *prog, int op, int out, int out1)
+{
+    if (prog->numStates == prog->cap)
+    {
+        prog->cap = prog->cap ? prog->cap * 2 : 32;
+        prog->states = realloc(prog->states, sizeof(regexState) * prog->cap);
+        if (prog->states == NULL)
+            die("realloc");
+    }
+    regexState *st = &prog->states[prog->numStates];
+    st->op = op;
+    st->out = out;
+    st->out1 = out1;
+    memset(st->set, 0, sizeof(st->set));
+    return prog->numStates++;
+}
+
+regexFrag regexSetFrag(regexParser *ps, const unsigned char *set)
+{
+    int e = regexAddState(ps->prog, RE_EPS, -1, -1);
+    int s = regexAddState(ps->prog, RE_SET, e, -1);
+    memcpy(ps->prog->states[s].set, set, sizeof(ps->prog->states[s].set));
+    regexFrag f = {s, e};
+    return f;
+}
+
+// Parses the escape after a backslash into `set`. Returns the byte it stands
+// for, or -1 for a class such as \d.
+int regexParseEscape(regexParser *ps, unsigned char *set)
+{
+    if (ps->p == ps->end)
+    {
+        ps->error = 1;
+        return -1;
+    }
+    int c = (unsigned char)*ps->p++;
+    int lower = tolower(c);
+    if (lower == 'd' || lower == 'w' || lower == 's')
+    {
+        unsigned char cls[32] = {0};
+        for (int b = 0; b < 256; b++)
+            if ((lower == 'd' && isdigit(b)) || (lower == 'w' && (isalnum(b) || b == '_')) ||
+                (lower == 's' && isspace(b)))
+                regexSetAdd(cls, b);
+        for (int j = 0; j < 32; j++)
+            set[j] |= c == lower ? cls[j] : (unsigned char)~cls[j];
+        return -1;
+    }
+    if (c == 't')
+        c = '\t';
+    regexSetAdd(set, c);
+    return c;
+}
+
+// Parses a bracket expression after its '['.
+void regexParseClass(regexParser *ps, unsigned char *set)
+{
+    unsigned char cls[32] = {0};
+    int negate = ps->p < ps->end && *ps->p == '^';
+    if (negate)
+        ps->p++;
+    int first = 1;
+    while (ps->p < ps->end && (*ps->p != ']' || first))
+    {
+        first = 0;
+        int lo = (unsigned char)*ps->p++;
+        if (lo == '\\' && (lo = regexParseEscape(ps, cls)) < 0)
+            continue;
+        if (ps->p + 1 < ps->end && ps->p[0] == '-' && ps->p[1] != ']')
+        {
+            int hi = (unsigned char)ps->p[1];
+            ps->p += 2;
+            if (hi == '\\' && (hi = regexParseEscape(ps, cls)) < 0)
+            {
+                ps->error = 1;
+                return;
+            }
+            for (int b = lo; b <= hi; b++)
+                regexSetAdd(cls, b);
+        }
+        else
+            regexSetAdd(cls, lo);
+    }
+    if (ps->p == ps->end)
+    {
+        ps->error = 1;
+        return;
+    }
+    ps->p++;
+    for (int j = 0; j < 32; j++)
+        set[j] = negate ? (unsigned char)~cls[j] : cls[j];
+}
+
+regexFrag regexParseAlt(regexParser *ps);
+
+regexFrag regexParseAtom(regexParser *ps)
+{
+    unsigned char set[32] = {0};
+    int c = (unsigned char)*ps->p++;
+    if (c == '(')
+    {
+        regexFrag f = regexParseAlt(ps);
+        if (ps->p == ps->end || *ps->p != ')')
+            ps->error = 1;
+        else
+            ps->p++;
+        return f;
+    }
+    if (c == '.')
+        memset(set, 0xff, sizeof(set));
+    else if (c == '[')
+        regexParseClass(ps, set);
+    else if (c == '\\')
+        regexParseEscape(ps, set);
+    else if (c == '*' || c == '+' || c == '?' || c == '^' || c == '$')
+        ps->error = 1;
+    else
+        regexSetAdd(set, c);
+    return regexSetFrag(ps, set);
+}
+
+regexFrag regexParseRepeat(regexParser *ps)
+{
+    regexProg *prog = ps->prog;
+    regexFrag f = regexParseAtom(ps);
+    while (!ps->error && ps->p < ps->end && (*ps->p == '*' || *ps->p == '+' || *ps->p == '?'))
+    {
+        char op = *ps->p++;
+        int e = regexAddState(prog, RE_EPS, -1, -1);
+        int s = regexAddState(prog, RE_SPLIT, f.start, e);
+        if (op == '?')
+        {
+            prog->states[f.end].out = e;
+            f.start = s;
+        }
+        else
+        {
+            prog->states[f.end].out = s;
+            if (op == '*')
+                f.start = s;
+        }
+        f.end = e;
+    }
+    return f;
+}
+
+regexFrag regexParseConcat(regexParser *ps)
+{
+    int e = regexAddState(ps->prog, RE_EPS, -1, -1);
+    regexFrag f = {e, e};
+    while (!ps->error && ps->p < ps->end && *ps->p != '|' && *ps->p != ')')
+    {
+        regexFrag g = regexParseRepeat(ps);
+        ps->prog->states[f.end].out = g.start;
+        f.end = g.end;
+    }
+    return f;
+}
+
+regexFrag regexParseAlt(regexParser *ps)
+{
+    regexProg *prog = ps->prog;
+    regexFrag f = regexParseConcat(ps);
+    while (!ps->error && ps->p < ps->end && *ps->p == '|')
+    {
+        ps->p++;
+        regexFrag g = regexParseConcat(ps);
+        int e = regexAddState(prog, RE_EPS, -1, -1);
+        int s = regexAddState(prog, RE_SPLIT, f.start, g.start);
+        prog->states[f.end].out = e;
+        prog->states[g.end].out = e;
+        f.start = s;
+        f.end = e;
+    }
+    return f;
+}
+
+// Adds the consuming and match states reachable from `s` without input to
+// set[0..*n). Each state is taken once per `gen`.
+void regexClosure(const regexProg *prog, int s, int *set, int *n, int *stack, int *seen, int gen)
+{
+    int top = 0;
+    stack[top++] = s;
+    while (top)
+    {
+        int i = stack[--top];
+        if (i < 0 || seen[i] == gen)
+            continue;
+        seen[i] = gen;
+        const regexState *st = &prog->states[i];
+        if (st->op == RE_SPLIT)
+        {
+            stack[top++] = st->out1;
+            stack[top++] = st->out;
+        }
+        else if (st->op == RE_EPS)
+            stack[top++] = st->out;
+        else
+            set[(*n)++] = i;
+    }
+}
+
+// Works out which bytes can begin a match and the literal every match starts
+// with: while the closure is a single one-byte set, that byte is forced.
+void regexAnalyze(regexProg *prog)
+{
+    int *set = malloc(sizeof(int) * prog->numStates);
+    int *stack = malloc(sizeof(int) * (2 * prog->numStates + 1));
+    int *seen = calloc(prog->numStates, sizeof(int));
+    if (set == NULL || stack == NULL || seen == NULL)
+        die("malloc");
+
+    int n = 0;
+    regexClosure(prog, prog->start, set, &n, stack, seen, 1);
+    for (int j = 0; j < n; j++)
+    {
+        const regexState *st = &prog->states[set[j]];
+        for (int b = 0; b < 32; b++)
+            prog->first[b] |= st->op == RE_MATCH ? 0xff : st->set[b];
+    }
+
+    int at = prog->start;
+    for (int gen = 2; prog->prefixLen < REGEX_PREFIX_MAX; gen++)
+    {
+        n = 0;
+        regexClosure(prog, at, set, &n, stack, seen, gen);
+        if (n != 1 || prog->states[set[0]].op != RE_SET)
+            break;
+        const regexState *st = &prog->states[set[0]];
+        int byte = -1, count = 0;
+        for (int b = 0; b < 256 && count < 2; b++)
+            if (regexSetHas(st->set, b))
+            {
+                byte = b;
+                count++;
             }
-        }
+        if (count != 1)
+            break;
+        prog->prefix[prog->prefixLen++] = byte;
+        at = st->out;
+    }
+    free(set);
+    free(stack);
+    free(seen);
+}
 
-        prevSep = is_separator(c);
-        i++;
+// Makes hub `from` of a reversed program also lead to state `to`. Hubs start
+// as empty epsilons and grow a chain of splits, one per edge.
+void regexReverseLink(regexProg *rev, int from, int to)
+{
+    if (from < 0)
+        return;
+    if (rev->states[from].out == -1)
+        rev->states[from].out = to;
+    else
+    {
+        int s = regexAddState(rev, RE_SPLIT, rev->states[from].out, to);
+        rev->states[from].out = s;
     }
+}
 
-    int changed = (row->hlOpenComment != inComment);
-    row->hlOpenComment = inComment;
-    if (changed && row->idx + 1 < E.numRows)
-        editorUpdateSyntax(&E.rows[row->idx + 1]);
+// Builds the NFA matching the reverse of every string `prog` matches: state u
+// of `prog` becomes hub u, every edge is turned around, and a byte set moves
+// onto the reversed edge. Run backwards over a row, its DFA accepts at each
+// column where a match starts.
+regexProg *regexReverse(const regexProg *prog)
+{
+    regexProg *rev = calloc(1, sizeof(regexProg));
+    if (rev == NULL)
+        die("calloc");
+    int n = prog->numStates;
+    for (int u = 0; u < n; u++)
+        regexAddState(rev, RE_EPS, -1, -1);
+    int accept = regexAddState(rev, RE_MATCH, -1, -1);
+    for (int w = 0; w < n; w++)
+    {
+        const regexState *st = &prog->states[w];
+        if (st->op == RE_SET)
+        {
+            int x = regexAddState(rev, RE_SET, w, -1);
+            memcpy(rev->states[x].set, st->set, sizeof(st->set));
+            regexReverseLink(rev, st->out, x);
+        }
+        else if (st->op == RE_EPS)
+            regexReverseLink(rev, st->out, w);
+        else if (st->op == RE_SPLIT)
+        {
+            regexReverseLink(rev, st->out, w);
+            regexReverseLink(rev, st->out1, w);
+        }
+        else
+            rev->start = w;
+    }
+    regexReverseLink(rev, prog->start, accept);
+    rev->anchorStart = prog->anchorEnd;
+    rev->anchorEnd = prog->anchorStart;
+    return rev;
 }
 
-void editorSelectSyntaxHighlight()
+void regexFree(regexProg *prog)
 {
-    E.syntax = NULL;
-    if (!E.filename)
+    if (prog == NULL)
         return;
-    char *ext = strrchr(E.filename, '.');
-    for (unsigned int j = 0; j < HLDB_ENTRIES; j++)
+    regexFree(prog->reverse);
+    free(prog->states);
+    free(prog);
+}
+
+// Compiles a pattern into a Thompson NFA, or returns NULL if it does not
+// parse. Supported: literals, '.', [classes], \d \w \s and their negations,
+// * + ?, alternation and groups. '^' and '$' anchor only at the pattern's
+// ends.
+regexProg *regexCompile(const char *pattern, int len)
+{
+    regexProg *prog = calloc(1, sizeof(regexProg));
+    if (prog == NULL)
+        die("calloc");
+    const char *end = pattern + len;
+    if (pattern < end && *pattern == '^')
     {
-        editorSyntax *s = &HLDB[j];
-        unsigned int i = 0;
-        while (s->fileMatch[i])
+        prog->anchorStart = 1;
+        pattern++;
+    }
+    if (end > pattern && end[-1] == '$')
+    {
+        int slashes = 0;
+        while (end - 2 - slashes >= pattern && end[-2 - slashes] == '\\')
+            slashes++;
+        if (slashes % 2 == 0)
         {
-            int is_ext = (s->fileMatch[i][0] == '.');
-            if ((is_ext && ext && !strcmp(ext, s->fileMatch[i])) ||
-                (!is_ext && strstr(E.filename, s->fileMatch[i])))
-            {
-                E.syntax = s;
-                int fileRow;
-                for (fileRow = 0; fileRow < E.numRows; fileRow++)
-                    editorUpdateSyntax(&E.rows[fileRow]);
-                return;
-            }
-            i++;
+            prog->anchorEnd = 1;
+            end--;
         }
     }
+
+    regexParser ps = {pattern, end, prog, 0};
+    regexFrag f = regexParseAlt(&ps);
+    if (ps.error || ps.p != end)
+    {
+        regexFree(prog);
+        return NULL;
+    }
+    // regexAddState may move the states, so take the index first.
+    int match = regexAddState(prog, RE_MATCH, -1, -1);
+    prog->states[f.end].out = match;
+    prog->start = f.start;
+    regexAnalyze(prog);
+    prog->reverse = regexReverse(prog);
+    return prog;
 }
 
-// Output
+int regexIntCmp(const void *a, const void *b)
+{
+    return *(const int *)a - *(const int *)b;
+}
 
-void editorSetStatusMessage(const char *fmt, ...)
+unsigned int regexSetHash(const int *set, int n)
 {
-    va_list ap;
-    va_start(ap, fmt);
-    vsnprintf(E.statusMsg, sizeof(E.statusMsg), fmt, ap);
-    va_end(ap);
-    E.statusMsgTime = time(NULL);
+    unsigned int h = 2166136261u;
+    for (int j = 0; j < n; j++)
+        h = (h ^ (unsigned int)set[j]) * 16777619u;
+    return h;
 }
 
-void editorDrawMessageBar(aBuf *ab)
+// Drops every cached state but the start state, whose index stays 0.
+void regexDfaFlush(regexDfa *d)
 {
-    abAppend(ab, "\x1b[K", 3);
-    int msglen = strlen(E.statusMsg);
-    if (msglen > E.screenCols)
-        msglen = E.screenCols;
-    if (msglen && time(NULL) - E.statusMsgTime < 5)
-        abAppend(ab, E.statusMsg, msglen);
+    for (int j = 1; j < d->count; j++)
+    {
+        free(d->states[j]->set);
+        free(d->states[j]);
+    }
+    d->count = 1;
+    d->epoch++;
+    for (int j = 0; j < REGEX_DFA_STATES * 2; j++)
+        d->table[j] = -1;
+    regexDfaState *st = d->states[0];
+    d->table[regexSetHash(st->set, st->n) & (REGEX_DFA_STATES * 2 - 1)] = 0;
+    for (int c = 0; c < 256; c++)
+        st->next[c] = REGEX_UNKNOWN;
 }
 
-void editorDrawStatusBar(aBuf *ab)
+// Returns the DFA state for an NFA state set, creating it if needed. When the
+// cache is full it is flushed and refilled as the scan goes on, so memory
+// stays bounded whatever the pattern.
+int regexDfaAdd(regexDfa *d, int *set, int n)
 {
-    abAppend(ab, "\x1b[7m", 4);
-    char status[80], rStatus[80];
-    int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
-                       E.filename ? E.filename : "[No Name]", E.numRows,
-                       E.dirty ? "(modified)" : "");
+    if (n == 0 && !d->unanchored)
+        return REGEX_DEAD;
+    qsort(set, n, sizeof(int), regexIntCmp);
+    unsigned int mask = REGEX_DFA_STATES * 2 - 1;
+    unsigned int slot = regexSetHash(set, n) & mask;
+    for (; d->table[slot] != -1; slot = (slot + 1) & mask)
+    {
+        const regexDfaState *st = d->states[d->table[slot]];
+        if (st->n == n && !memcmp(st->set, set, sizeof(int) * n))
+            return d->table[slot];
+    }
+    if (d->count == REGEX_DFA_STATES)
+    {
+        regexDfaFlush(d);
+        return regexDfaAdd(d, set, n);
+    }
 
-    int rLen = snprintf(rStatus, sizeof(rStatus), "%s | %d/%d", E.syntax ? E.syntax->fileType : "no ft",
-                        E.cy + 1, E.numRows);
+    regexDfaState *st = malloc(sizeof(regexDfaState));
+    if (st == NULL || (st->set = malloc(sizeof(int) * (n ? n : 1))) == NULL)
+        die("malloc");
+    memcpy(st->set, set, sizeof(int) * n);
+    st->n = n;
+    st->accept = 0;
+    for (int j = 0; j < n; j++)
+        if (d->prog->states[set[j]].op == RE_MATCH)
+            st->accept = 1;
+    for (int c = 0; c < 256; c++)
+        st->next[c] = REGEX_UNKNOWN;
+    d->states[d->count] = st;
+    d->table[slot] = d->count;
+    return d->count++;
+}
 
-    if (len > E.screenCols)
-        len = E.screenCols;
+// An unanchored DFA re-enters the start state at every byte, so it accepts
+// as soon as a match ends anywhere; an anchored one tracks a single start.
+void regexDfaInit(regexDfa *d, const regexProg *prog, int unanchored)
+{
+    d->prog = prog;
+    d->unanchored = unanchored;
+    d->states = malloc(sizeof(regexDfaState *) * REGEX_DFA_STATES);
+    d->table = malloc(sizeof(int) * REGEX_DFA_STATES * 2);
+    d->stack = malloc(sizeof(int) * (2 * prog->numStates + 1));
+    d->seen = calloc(prog->numStates, sizeof(int));
+    d->scratch = malloc(sizeof(int) * prog->numStates);
+    if (d->states == NULL || d->table == NULL || d->stack == NULL || d->seen == NULL ||
+        d->scratch == NULL)
+        die("malloc");
+    d->count = 0;
+    d->gen = 0;
+    d->epoch = 0;
+    for (int j = 0; j < REGEX_DFA_STATES * 2; j++)
+        d->table[j] = -1;
 
-    abAppend(ab, status, len);
+    int n = 0;
+    regexClosure(prog, prog->start, d->scratch, &n, d->stack, d->seen, ++d->gen);
+    d->start = regexDfaAdd(d, d->scratch, n);
+}
 
-    while (len < E.screenCols)
+void regexDfaFree(regexDfa *d)
+{
+    for (int j = 0; j < d->count; j++)
     {
-        if (E.screenCols - len == rLen)
-        {
-            abAppend(ab, rStatus, rLen);
+        free(d->states[j]->set);
+        free(d->states[j]);
+    }
+    free(d->states);
+    free(d->table);
+    free(d->stack);
+    free(d->seen);
+    free(d->scratch);
+}
+
+// Computes and caches the transition of state `s` on byte `c`.
+int regexDfaStep(regexDfa *d, int s, unsigned char c)
+{
+    const regexProg *prog = d->prog;
+    const regexDfaState *st = d->states[s];
+    int n = 0;
+    d->gen++;
+    for (int j = 0; j < st->n; j++)
+    {
+        const regexState *ns = &prog->states[st->set[j]];
+        if (ns->op == RE_SET && regexSetHas(ns->set, c))
+            regexClosure(prog, ns->out, d->scratch, &n, d->stack, d->seen, d->gen);
+    }
+    if (d->unanchored)
+        regexClosure(prog, prog->start, d->scratch, &n, d->stack, d->seen, d->gen);
+
+    int epoch = d->epoch;
+    int next = regexDfaAdd(d, d->scratch, n);
+    if (d->epoch == epoch)
+        d->states[s]->next[c] = next;
+    return next;
+}
+
+// Returns the end of the longest match starting at text[at], or -1.
+int regexMatchAt(regexDfa *d, const char *text, int size, int at)
+{
+    int anchorEnd = d->prog->anchorEnd;
+    int s = d->start;
+    int end = -1;
+    for (int i = at;; i++)
+    {
+        if (d->states[s]->accept && (!anchorEnd || i == size))
+            end = i;
+        if (i == size)
             break;
-        }
-        else
-        {
+        int next = d->states[s]->next[(unsigned char)text[i]];
+        if (next == REGEX_UNKNOWN)
+            next = regexDfaStep(d, s, text[i]);
+        if (next == REGEX_DEAD)
+            break;
+        s = next;
+    }
+    return end;
+}
 
-            abAppend(ab, " ", 1);
-            len++;
-        }
+// Returns the end of the last match in text[0..size), or -1, in one pass of
+// an unanchored DFA. Bytes that cannot start a match leave the start state
+// as it is, so they are skipped without a transition.
+int regexMatchLast(regexDfa *d, const char *text, int size)
+{
+    const unsigned char *first = d->prog->first;
+    int anchorEnd = d->prog->anchorEnd;
+    int s = d->start;
+    int last = -1;
+    for (int i = 0;; i++)
+    {
+        if (s == d->start)
+            while (i < size && !regexSetHas(first, text[i]))
+                i++;
+        if (d->states[s]->accept && (!anchorEnd || i == size))
+            last = i;
+        if (i == size)
+            return last;
+        int next = d->states[s]->next[(unsigned char)text[i]];
+        if (next == REGEX_UNKNOWN)
+            next = regexDfaStep(d, s, text[i]);
+        s = next;
     }
-    abAppend(ab, "\x1b[m", 3);
-    abAppend(ab, "\r\n", 2);
 }
 
-void editorScroll()
+// Sets starts[i] for each column i of text[0..size) where a match ending at
+// or before `size` starts, running the DFA of a reversed program backwards
+// from `size`.
+void regexMatchStarts(regexDfa *d, const char *text, int size, char *starts)
 {
-    E.rx = 0;
-    if (E.cy < E.numRows)
-        E.rx = editorRowCxToRx(&E.rows[E.cy], E.cx);
+    memset(starts, 0, size);
+    int s = d->start;
+    for (int i = size; i > 0; i--)
+    {
+        int next = d->states[s]->next[(unsigned char)text[i - 1]];
+        if (next == REGEX_UNKNOWN)
+            next = regexDfaStep(d, s, text[i - 1]);
+        if (next == REGEX_DEAD)
+            return;
+        s = next;
+        starts[i - 1] = d->states[s]->accept;
+    }
+}
 
-    if (E.cy < E.rowOff)
-        E.rowOff = E.cy;
-    if (E.cy >= E.rowOff + E.screenRows)
-        E.rowOff = E.cy - E.screenRows + 1;
+// find feature
 
-    if (E.rx < E.colOff)
-        E.colOff = E.rx;
-    if (E.rx >= E.colOff + E.screenCols)
-        E.colOff = E.rx - E.screenCols + 1;
+void searchIndexAdd(searchIndex *idx, int row, int col, int len)
+{
+    if (idx->count == idx->cap)
+    {
+        idx->cap = idx->cap ? idx->cap * 2 : 64;
+        idx->matches = realloc(idx->matches, sizeof(searchMatch) * idx->cap);
+        if (idx->matches == NULL)
+            die("realloc");
+    }
+    idx->matches[idx->count].row = row;
+    idx->matches[idx->count].col = col;
+    idx->matches[idx->count].len = len;
+    idx->count++;
 }
 
-void editorDrawRows(aBuf *ab)
+void searchIndexFree(searchIndex *idx)
 {
-    for (int y = 0; y < E.screenRows; y++)
+    free(idx->matches);
+    free(idx->query);
+    idx->matches = NULL;
+    idx->query = NULL;
+    idx->queryLen = 0;
+    idx->count = 0;
+    idx->cap = 0;
+    idx->current = -1;
+    idx->active = 0;
+    idx->invalid = 0;
+}
+
+// Returns the first match at or after (row, col), or idx->count.
+int searchIndexLowerBound(const searchIndex *idx, int row, int col)
+{
+    int lo = 0, hi = idx->count;
+    while (lo < hi)
     {
-        int fileRow = y + E.rowOff;
-        if (fileRow >= E.numRows)
-        {
+        int mid = lo + (hi - lo) / 2;
+        const searchMatch *m = &idx->matches[mid];
+        if (m->row < row || (m->row == row && m->col < col))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
 
-            if (E.numRows == 0 && y == E.screenRows / 3)
+// Whether the row still covers exactly its own entry of the line index, so
+// its text lies in the original file right after the previous line's. An
+// empty line qualifies only while its entry is empty too.
+int editorRowBorrowed(const editorRow *row)
+{
+    return row->pieceCap == 0 && row->pieces != NULL && row->numPieces <= 1 &&
+           row->size == row->pieces[0].len;
+}
+
+// Returns the row's text as one buffer. A row split into several pieces is
+// copied into *copy, which the caller frees.
+const char *editorRowText(editorRow *row, char **copy)
+{
+    *copy = NULL;
+    if (row->numPieces == 0)
+        return "";
+    if (row->numPieces == 1)
+        return row->pieces[0].start;
+    *copy = malloc(row->size);
+    if (*copy == NULL)
+        die("malloc");
+    textRowCopy(row, *copy);
+    return *copy;
+}
+
+// Records the match that starts at `col` of row `at`, if there is one, and
+// returns the column to resume from. Literal matches may overlap, so that a
+// longer query's matches are always a subset of a shorter one's; regex
+// matches are the longest at each start and do not overlap.
+int editorSearchHit(searchJob *job, const char *text, int size, int at, int col)
+{
+    if (job->prog == NULL)
+    {
+        searchIndexAdd(&job->out, at, col, job->len);
+        return col + 1;
+    }
+    int end = regexMatchAt(&job->dfa, text, size, col);
+    if (end > col)
+    {
+        searchIndexAdd(&job->out, at, col, end - col);
+        return end;
+    }
+    return col + 1;
+}
+
+// Finds a regex's matches in one row without backtracking: a forward pass
+// of the unanchored DFA rejects a row with no match and finds where the last
+// match ends, a backward pass of the reversed DFA marks where matches start,
+// and only from those columns does the anchored DFA look for the longest
+// match, never past the last end.
+void editorSearchRegexRow(searchJob *job, const char *text, int size, int at)
+{
+    const regexProg *prog = job->prog;
+    if (prog->anchorStart)
+    {
+        editorSearchHit(job, text, size, at, 0);
+        return;
+    }
+    int last = regexMatchLast(&job->dfaAny, text, size);
+    if (last <= 0)
+        return;
+    if (last > job->startsCap)
+    {
+        job->startsCap = last * 2;
+        free(job->starts);
+        job->starts = malloc(job->startsCap);
+        if (job->starts == NULL)
+            die("malloc");
+    }
+    regexMatchStarts(&job->dfaRev, text, last, job->starts);
+    for (int col = 0; col < last;)
+        col = job->starts[col] ? editorSearchHit(job, text, last, at, col) : col + 1;
+}
+
+// Collects the matches in the job's rows in order. Candidates come from the
+// SIMD literal scan (the query itself, or a regex's literal prefix). Unedited
+// rows that are still neighbours in the file are scanned as one span of the
+// original text; a query holds no control characters, so no literal can run
+// across the line breaks inside it. A regex's prefix only picks the rows to
+// search: each such row is searched once, as a whole.
+void editorSearchRows(searchJob *job)
+{
+    const char *lit = job->query;
+    int litLen = job->len;
+    int scan = 1;
+    if (job->prog)
+    {
+        lit = job->prog->prefix;
+        litLen = job->prog->prefixLen;
+        scan = litLen > 0 && !job->prog->anchorStart;
+    }
+    else if (litLen == 0)
+        return;
+
+    // Spans start small so the first hits come back cheaply, then double.
+    int span = EDITOR_SEARCH_SPAN_MIN;
+    for (int at = job->from; at < job->to; at++)
+    {
+        editorRow *row = editorRowAt(at);
+        if (!scan || !editorRowBorrowed(row))
+        {
+            char *copy;
+            const char *text = editorRowText(row, &copy);
+            if (job->prog)
             {
-                char welcome[80];
-                int wmLen = snprintf(welcome, sizeof(welcome),
-                                     "Custom Editor -- version %s", EDITOR_VERSION);
-                if (wmLen > E.screenCols)
-                    wmLen = E.screenCols;
-                int padding = (E.screenCols - wmLen) / 2;
-                if (padding)
-                {
-                    abAppend(ab, "~", 1);
-                    padding--;
-                }
-                while (padding--)
-                    abAppend(ab, " ", 1);
-                abAppend(ab, welcome, wmLen);
+                if (!scan || textSearch(text, row->size, lit, litLen))
+                    editorSearchRegexRow(job, text, row->size, at);
             }
             else
             {
-                abAppend(ab, "~", 1);
+                const char *p = text;
+                const char *hit;
+                while ((hit = textSearch(p, text + row->size - p, lit, litLen)) != NULL)
+                    p = text + editorSearchHit(job, text, row->size, at, hit - text);
             }
+            free(copy);
+            continue;
         }
-        else
+
+        int last = at;
+        while (last + 1 < job->to && last - at < span &&
+               editorRowBorrowed(editorRowAt(last + 1)) &&
+               editorRowAt(last + 1)->pieces == editorRowAt(last)->pieces + 1)
+            last++;
+        const char *p = row->pieces[0].start;
+        const char *end = editorRowAt(last)->pieces[0].start + editorRowAt(last)->pieces[0].len;
+        const char *hit;
+        while ((hit = textSearch(p, end - p, lit, litLen)) != NULL)
         {
-            int len = E.rows[fileRow].rsize - E.colOff;
-            if (len < 0)
-                len = 0;
-            if (len > E.screenCols)
-                len = E.screenCols;
-            char *s = &E.rows[fileRow].render[E.colOff];
-            unsigned char *hl = &E.rows[fileRow].hl[E.colOff];
-            int j;
-            int currentColor = -1;
-            for (j = 0; j < len; j++)
+            while (at < last && editorRowAt(at + 1)->pieces[0].start <= hit)
+                at++;
+            const char *text = editorRowAt(at)->pieces[0].start;
+            int size = editorRowAt(at)->size;
+            if (job->prog)
             {
-                if (iscntrl(s[j]))
-                {
-                    char sym = (s[j] <= 26) ? '@' + s[j] : '?';
-                    abAppend(ab, "\x1b[7m", 4);
-                    abAppend(ab, &sym, 1);
-                    abAppend(ab, "\x1b[m", 3);
-                    if (currentColor != -1)
-                    {
-                        char buf[16];
-                        int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", currentColor);
-                        abAppend(ab, buf, clen);
-                    }
-                }
-                else if (hl[j] == HL_NORMAL)
-                {
-                    if (currentColor != -1)
-                    {
-                        abAppend(ab, "\x1b[39m", 5);
-                        currentColor = -1;
-                    }
-                    abAppend(ab, &s[j], 1);
-                }
-                else
-                {
-                    int color = editorSyntaxToColor(hl[j]);
-                    if (color != currentColor)
-                    {
-
-                        currentColor = color;
-                        char buf[16];
-                        int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
-                        abAppend(ab, buf, clen);
-                    }
-                    abAppend(ab, &s[j], 1);
-                }
+                editorSearchRegexRow(job, text, size, at);
+                p = text + size;
             }
-            abAppend(ab, "\x1b[39m", 5);
+            else
+                p = text + editorSearchHit(job, text, size, at, hit - text);
         }
-
-        abAppend(ab, "\x1b[K", 3);
-        abAppend(ab, "\r\n", 2);
+        at = last;
+        if (span < EDITOR_SEARCH_SPAN_ROWS)
+            span *= 2;
     }
 }
 
-void editorRefreshScreen()
+void *editorSearchJobRun(void *arg)
 {
-    editorScroll();
-
-    aBuf ab = {.b = NULL, .len = 0};
+    searchJob *job = arg;
+    if (job->prog)
+    {
+        regexDfaInit(&job->dfa, job->prog, 0);
+        regexDfaInit(&job->dfaAny, job->prog, 1);
+        regexDfaInit(&job->dfaRev, job->prog->reverse, !job->prog->anchorEnd);
+    }
+    editorSearchRows(job);
+    if (job->prog)
+    {
+        regexDfaFree(&job->dfa);
+        regexDfaFree(&job->dfaAny);
+        regexDfaFree(&job->dfaRev);
+    }
+    free(job->starts);
+    return NULL;
+}
 
-    abAppend(&ab, "\x1b[?25l", 6);
-    abAppend(&ab, "\x1b[H", 3);
+// Rebuilds E.search for `query`, as a regex when E.searchRegex is set. Rows
+// are split into contiguous ranges searched by separate threads; since the
+// ranges are in order, their results concatenate into a sorted index.
+void editorSearchAll(const char *query)
+{
+    int len = strlen(query);
+    regexProg *prog = NULL;
+    if (E.searchRegex && len > 0 && (prog = regexCompile(query, len)) == NULL)
+    {
+        searchIndexFree(&E.search);
+        E.search.active = 1;
+        E.search.invalid = 1;
+        return;
+    }
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int n = E.numRows / EDITOR_SEARCH_MIN_ROWS + 1;
+    if (cpus > 0 && n > cpus)
+        n = cpus;
+    if (n > EDITOR_SEARCH_MAX_THREADS)
+        n = EDITOR_SEARCH_MAX_THREADS;
 
-    editorDrawRows(&ab);
-    editorDrawStatusBar(&ab);
-    editorDrawMessageBar(&ab);
+    searchJob jobs[EDITOR_SEARCH_MAX_THREADS];
+    pthread_t threads[EDITOR_SEARCH_MAX_THREADS];
+    int started = 0;
+    for (int j = 0; j < n; j++)
+    {
+        jobs[j].from = (long long)E.numRows * j / n;
+        jobs[j].to = (long long)E.numRows * (j + 1) / n;
+        jobs[j].query = query;
+        jobs[j].len = len;
+        jobs[j].prog = prog;
+        jobs[j].starts = NULL;
+        jobs[j].startsCap = 0;
+        memset(&jobs[j].out, 0, sizeof(searchIndex));
+    }
+    // The jobs read rows at the same time, so none may be left to fill.
+    lineIndexInitRows(E.numRows);
+    for (int j = 1; j < n; j++)
+    {
+        if (pthread_create(&threads[j], NULL, editorSearchJobRun, &jobs[j]) != 0)
+            break;
+        started = j;
+    }
+    for (int j = started + 1; j < n; j++)
+        editorSearchJobRun(&jobs[j]);
+    editorSearchJobRun(&jobs[0]);
+    for (int j = 1; j <= started; j++)
+        pthread_join(threads[j], NULL);
 
-    char buf[32];
-    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowOff) + 1, (E.rx - E.colOff) + 1);
-    abAppend(&ab, buf, strlen(buf));
+    searchIndexFree(&E.search);
+    E.search = jobs[0].out;
+    for (int j = 1; j < n; j++)
+    {
+        for (int k = 0; k < jobs[j].out.count; k++)
+            searchIndexAdd(&E.search, jobs[j].out.matches[k].row, jobs[j].out.matches[k].col,
+                           jobs[j].out.matches[k].len);
+        free(jobs[j].out.matches);
+    }
+    regexFree(prog);
+    E.search.query = malloc(len + 1);
+    if (E.search.query == NULL)
+        die("malloc");
+    memcpy(E.search.query, query, len + 1);
+    E.search.queryLen = len;
+    E.search.active = 1;
+    E.search.current = -1;
+}
 
-    abAppend(&ab, "\x1b[?25h", 6);
+// The query grew by a few characters since the index was built, so its
+// matches are exactly the old matches that are still followed by the new
+// characters; only those are checked, and the index shrinks in place.
+void editorSearchRefine(const char *query)
+{
+    searchIndex *idx = &E.search;
+    int len = strlen(query);
+    int kept = 0;
+    for (int j = 0; j < idx->count; j++)
+    {
+        searchMatch m = idx->matches[j];
+        m.len = len;
+        if (textRowMatch(editorRowAt(m.row), m.col + idx->queryLen, query + idx->queryLen,
+                         len - idx->queryLen))
+            idx->matches[kept++] = m;
+    }
+    idx->count = kept;
 
-    write(STDOUT_FILENO, ab.b, ab.len);
-    abFree(&ab);
+    char *copy = realloc(idx->query, len + 1);
+    if (copy == NULL)
+        die("realloc");
+    memcpy(copy, query, len + 1);
+    idx->query = copy;
+    idx->queryLen = len;
 }
 
-// find feature
-
 void editorFindCallback(char *query, int key)
 {
-
-    static int lastMatch = -1;
-    static int direction = 1;
-
     static int savedLineHL;
     static char *savedHL = NULL;
+    static unsigned int savedGen;
+    static unsigned char *savedBuf;
+    static int savedLen;
     if (savedHL)
     {
-        memcpy(E.rows[savedLineHL].hl, savedHL, E.rows[savedLineHL].rsize);
+        // Restore only the buffer that was marked: if the row was edited or
+        // the worker published new highlighting for it, that one is current.
+        editorRow *row = savedLineHL < E.numRows ? editorRowAt(savedLineHL) : NULL;
+        if (row && E.hlGen == savedGen && row->hl == savedBuf && row->rsize == savedLen)
+            memcpy(row->hl, savedHL, savedLen);
         free(savedHL);
         savedHL = NULL;
     }
 
     if (key == '\r' || key == '\x1b')
     {
-        lastMatch = -1;
-        direction = 1;
+        searchIndexFree(&E.search);
         return;
     }
-    else if (key == ARROW_RIGHT || key == ARROW_DOWN)
-        direction = 1;
+
+    searchIndex *idx = &E.search;
+    if (key == ARROW_RIGHT || key == ARROW_DOWN)
+    {
+        if (idx->current != -1)
+            idx->current = searchIndexLowerBound(idx, E.cy, E.cx + 1);
+    }
     else if (key == ARROW_LEFT || key == ARROW_UP)
-        direction = -1;
+    {
+        if (idx->current != -1)
+            idx->current = searchIndexLowerBound(idx, E.cy, E.cx) - 1;
+    }
     else
     {
-        lastMatch = -1;
-        direction = 1;
+        if (key == CTRL_KEY('r'))
+            E.searchRegex = !E.searchRegex;
+        if (!E.searchRegex && idx->queryLen > 0 && (int)strlen(query) > idx->queryLen &&
+            !strncmp(query, idx->query, idx->queryLen))
+            editorSearchRefine(query);
+        else
+            editorSearchAll(query);
+        idx->current = 0;
     }
 
-    if (lastMatch == -1)
-        direction = 1;
-    int current = lastMatch;
-
-    int i;
-    for (i = 0; i < E.numRows; i++)
-    {
-        current += direction;
-        if (current == -1)
-            current = E.numRows - 1;
-        else if (current == E.numRows)
-            current = 0;
-
-        editorRow *row = &E.rows[current];
-        char *match = strstr(row->render, query);
-        if (match)
-        {
-            lastMatch = current;
-            E.cy = current;
-            E.cx = editorRowRxToCx(row, match - row->render);
-
-            savedLineHL = current;
-            savedHL = malloc(row->rsize);
-            memcpy(savedHL, row->hl, row->rsize);
-            memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
-
-            if (E.screenRows < E.numRows)
-                E.rowOff = E.numRows;
-            if (E.cx < E.screenCols)
-                E.colOff = 0;
-            else
-                E.colOff = E.cx;
-            break;
-        }
+    if (idx->count == 0)
+    {
+        idx->current = -1;
+        return;
     }
+    if (idx->current >= idx->count)
+        idx->current = 0;
+    else if (idx->current < 0)
+        idx->current = idx->count - 1;
+
+    const searchMatch *match = &idx->matches[idx->current];
+    editorRowPrepare(match->row);
+    editorRow *row = editorRowAt(match->row);
+    int rx = editorRowCxToRx(row, match->col);
+    int rxEnd = editorRowCxToRx(row, match->col + match->len);
+    E.cy = match->row;
+    E.cx = match->col;
+
+    savedLineHL = match->row;
+    savedGen = E.hlGen;
+    savedBuf = row->hl;
+    savedLen = row->rsize;
+    savedHL = malloc(row->rsize);
+    memcpy(savedHL, row->hl, row->rsize);
+    memset(&row->hl[rx], HL_MATCH, rxEnd - rx);
+
+    if (E.screenRows < E.numRows)
+        E.rowOff = E.numRows;
+    if (E.cx < E.screenCols)
+        E.colOff = 0;
+    else
+        E.colOff = E.cx;
 }
 
 void editorFind()
@@ -1097,7 +4876,7 @@ void editorFind()
     int savedColOff = E.colOff;
     int savedRowOff = E.rowOff;
 
-    char *query = editorPrompt("Search: %s (Use ESC/Arrows/Enter)", editorFindCallback);
+    char *query = editorPrompt("Search: %s (Use ESC/Arrows/Enter, Ctrl-R regex)", 0, editorFindCallback);
     if (query)
     {
         free(query);
@@ -1111,6 +4890,110 @@ void editorFind()
     }
 }
 
+// Replaces every match of `query` at once and returns how many were replaced,
+// or -1 for a bad regex. All matches are found first (through the search
+// index, so regex mode applies too), then each row that has any is rebuilt
+// in a single pass and marked for one re-render. The replacement text is
+// stored once and shared by every occurrence.
+int editorReplaceAll(const char *query, const char *with, int *rows)
+{
+    lineGapFlush();
+    editorSearchAll(query);
+    if (E.search.invalid)
+    {
+        searchIndexFree(&E.search);
+        return -1;
+    }
+
+    int withLen = strlen(with);
+    textPiece piece = {withLen ? textAppend(with, withLen) : NULL, withLen};
+    searchMatch *batch = NULL;
+    int batchCap = 0;
+    char *text = NULL;
+    int textCap = 0;
+    int replaced = 0;
+    *rows = 0;
+    const searchMatch *m = E.search.matches;
+    const searchMatch *end = m + E.search.count;
+    while (m < end)
+    {
+        int at = m->row;
+        int n = 0, prevEnd = 0;
+        for (; m < end && m->row == at; m++)
+        {
+            if (m->col < prevEnd)
+                continue;
+            if (n == batchCap)
+            {
+                batchCap = batchCap ? batchCap * 2 : 16;
+                batch = realloc(batch, sizeof(searchMatch) * batchCap);
+                if (batch == NULL)
+                    die("realloc");
+            }
+            batch[n++] = *m;
+            prevEnd = m->col + m->len;
+        }
+        int shift = 0;
+        for (int k = 0; k < n; k++)
+        {
+            if (batch[k].len > textCap)
+            {
+                textCap = batch[k].len * 2;
+                text = realloc(text, textCap);
+                if (text == NULL)
+                    die("realloc");
+            }
+            textRowRead(editorRowAt(at), batch[k].col, batch[k].len, text);
+            undoPush(UNDO_DELETE, at, batch[k].col + shift, text, batch[k].len);
+            if (withLen)
+                undoPush(UNDO_INSERT, at, batch[k].col + shift, with, withLen);
+            shift += withLen - batch[k].len;
+        }
+        textRowReplace(editorRowAt(at), batch, n, piece);
+        editorUpdateRow(editorRowAt(at));
+        replaced += n;
+        (*rows)++;
+    }
+    free(batch);
+    free(text);
+    searchIndexFree(&E.search);
+
+    if (replaced)
+        E.dirty++;
+    if (E.cy < E.numRows && E.cx > editorRowAt(E.cy)->size)
+        E.cx = editorRowAt(E.cy)->size;
+    return replaced;
+}
+
+void editorReplace()
+{
+    char *query = editorPrompt(E.searchRegex ? "Replace regex: %s (ESC to cancel)"
+                                             : "Replace: %s (ESC to cancel)",
+                               0, NULL);
+    if (query == NULL)
+        return;
+    // An empty replacement deletes every match.
+    char *with = editorPrompt("With: %s (ESC to cancel)", 1, NULL);
+    if (with == NULL)
+    {
+        free(query);
+        return;
+    }
+
+    struct timespec t0, t1;
+    int rows;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    int replaced = editorReplaceAll(query, with, &rows);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    if (replaced < 0)
+        editorSetStatusMessage("Bad regex: %s", query);
+    else
+        editorSetStatusMessage("Replaced %d occurrences on %d lines in %.1f ms", replaced, rows,
+                               (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6);
+    free(query);
+    free(with);
+}
+
 // init
 
 void initEditorConfig()
@@ -1122,17 +5005,94 @@ void initEditorConfig()
     E.colOff = 0;
     E.numRows = 0;
     E.rows = NULL;
+    E.gapStart = 0;
+    E.gapLen = 0;
+    E.rowsFilled = 0;
+    E.rowsShift = 0;
+    E.edit.row = -1;
+    E.edit.buf = NULL;
+    E.edit.cap = 0;
+    E.edit.marks = NULL;
+    E.edit.numMarks = 0;
+    E.edit.markCap = 0;
+    E.hlValid = 0;
+    E.hlBudget = EDITOR_HL_BUDGET;
+    E.hlGen = 0;
+    E.hlWorker = 0;
+    E.hlStop = 0;
+    E.hlRedraw = 0;
+    pthread_mutex_init(&E.lock, NULL);
+    pthread_cond_init(&E.hlCond, NULL);
+    E.text.orig = NULL;
+    E.text.origLen = 0;
+    E.text.origMapped = 0;
+    E.text.origCopy = 0;
+    E.text.lines = NULL;
+    E.text.add = NULL;
+    E.search.matches = NULL;
+    E.search.query = NULL;
+    E.search.queryLen = 0;
+    E.search.count = 0;
+    E.search.cap = 0;
+    E.search.current = -1;
+    E.search.active = 0;
+    E.search.invalid = 0;
+    E.searchRegex = 0;
+    // umask can only be read by setting it, which would race the writer.
+    E.umask = umask(0);
+    umask(E.umask);
+    E.slab.chunks = NULL;
+    memset(E.slab.freeList, 0, sizeof(E.slab.freeList));
+    pthread_mutex_init(&E.slab.lock, NULL);
+    E.undo.buf = NULL;
+    E.undo.start = 0;
+    E.undo.pos = 0;
+    E.undo.len = 0;
+    E.undo.cap = 0;
+    E.undo.last = -1;
+    E.undo.group = 0;
+    E.undo.dropGroup = -1;
+    E.undo.typing = 0;
+    E.save.running = 0;
+    E.save.done = 0;
+    E.save.filename = NULL;
+    E.save.slices = NULL;
+    E.save.count = 0;
+    E.save.cap = 0;
+    E.journal.fd = -1;
+    E.journal.path = NULL;
+    E.journal.buf = NULL;
+    E.journal.len = 0;
+    E.journal.cap = 0;
+    E.journal.size = 0;
+    E.journal.haveBase = 0;
+    E.journal.failed = 0;
+    E.journal.replaying = 0;
+    E.journal.unsynced = 0;
+    E.journal.synced.tv_sec = 0;
+    E.journal.synced.tv_nsec = 0;
+    E.page.active = 0;
+    E.page.marks = NULL;
+    E.page.lines = 0;
+    E.page.done = 0;
+    E.page.stop = 0;
+    E.page.changed = 0;
+    E.page.indexing = 0;
     E.filename = NULL;
     E.statusMsg[0] = '\0';
     E.statusMsgTime = 0;
     E.dirty = 0;
     E.syntax = NULL;
+    E.frame.b = NULL;
+    E.frame.len = 0;
+    E.frame.cap = 0;
     editorSetStatusMessage(
         "HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find");
 
     if (getWindowSize(&E.screenRows, &E.screenCols) == -1)
         die("getWindowSize");
 
+    screenInit(E.screenRows, E.screenCols);
     E.screenRows -= 2;
 }
 
@@ -1140,8 +5100,10 @@ int main(int argc, char *argv[])
 {
     enableRawMode();
     initEditorConfig();
+    pthread_mutex_lock(&E.lock);
     if (argc >= 2)
         editorOpen(argv[1]);
+    editorStartHlWorker();
 
     while (1)
     {
@@ -3,14 +3,72 @@
 
 #include "termio.h"
 #include "time.h"
+#include "pthread.h"
+#include "sys/uio.h"
 
 #define EDITOR_VERSION "0.0.1"
 
 #define CTRL_KEY(k) ((k) & 0x1f)
 #define EDITOR_TAB_STOP 8
 #define EDITOR_QUIT_TIMES 1
+#define EDITOR_RENDER_LOOKAHEAD 8
+#define SCREEN_INVERSE 0x80
+#define SCREEN_GAP 4
+#define AB_INITIAL_CAP 4096
 #define HL_HIGHLIGHT_NUMBERS (1 << 0)
 #define HL_HIGHLIGHT_STRINGS (1 << 1)
+#define HL_KEYWORD_MAX_LEN 64
+#define HL_STATE_ML_COMMENT (1 << 0)
+#define HL_STATE_PREV_SEP (1 << 1)
+#define HL_STATE_PREV_NUMBER (1 << 2)
+#define HL_STATE_STRING_SHIFT 8
+#define EDITOR_HL_BUDGET 5000
+#define EDITOR_HL_IDLE_BATCH 5000
+#define HL_STATE_UNKNOWN -1
+#ifndef EDITOR_HL_WORKER
+#define EDITOR_HL_WORKER 1
+#endif
+#define EDITOR_HL_WORKER_WINDOW 200
+#define EDITOR_HL_WORKER_SKIPS 1024
+#ifndef EDITOR_UNDO_BUDGET
+#define EDITOR_UNDO_BUDGET (8 * 1024 * 1024)
+#endif
+#define SLAB_MIN_SHIFT 4
+#define SLAB_CLASSES 27
+#define SLAB_CHUNK_SIZE (256 * 1024)
+#define EDITOR_LINE_GAP 64
+#define EDITOR_RENDER_MARK 1024
+#define TEXT_ADD_BLOCK_SIZE (64 * 1024)
+#define EDITOR_SEARCH_SPAN_MIN 16
+#ifndef EDITOR_SEARCH_SPAN_ROWS
+#define EDITOR_SEARCH_SPAN_ROWS 65536
+#endif
+#define EDITOR_SEARCH_MIN_ROWS 16384
+#define EDITOR_SEARCH_MAX_THREADS 16
+#define REGEX_DFA_STATES 512
+#define REGEX_PREFIX_MAX 64
+#define REGEX_UNKNOWN -1
+#define REGEX_DEAD -2
+#ifndef EDITOR_INDEX_CHUNK
+#define EDITOR_INDEX_CHUNK (8 * 1024 * 1024)
+#endif
+#define EDITOR_INDEX_MAX_THREADS 16
+#define EDITOR_FILL_ROWS 4096
+#define EDITOR_ATOMIC_SAVE 1
+#define EDITOR_SAVE_IOV 1024
+#define EDITOR_SAVE_CHUNK (4 * 1024 * 1024)
+#ifndef EDITOR_PAGE_THRESHOLD
+#define EDITOR_PAGE_THRESHOLD (1LL << 30)
+#endif
+#ifndef EDITOR_PAGE_ROWS
+#define EDITOR_PAGE_ROWS 4096
+#endif
+#ifndef EDITOR_PAGE_STRIDE
+#define EDITOR_PAGE_STRIDE 65536
+#endif
+#define EDITOR_JOURNAL 1
+#define EDITOR_JOURNAL_SYNC_MS 1000
+#define EDITOR_JOURNAL_MAGIC "KEDJRNL1"
 
 enum editorKey
 {
@@ -39,17 +97,351 @@ enum editorHighlight
 
 };
 
+#define HL_CLASSES (HL_MATCH + 1)
+
+// A block the slab allocator carves row payloads from, bump-pointer style.
+typedef struct slabChunk
+{
+    struct slabChunk *next;
+    size_t used;
+    size_t cap;
+    char data[];
+} slabChunk;
+
+typedef struct slabAllocator
+{
+    slabChunk *chunks;
+    void *freeList[SLAB_CLASSES];
+    pthread_mutex_t lock;
+} slabAllocator;
+
+// A piece is a slice of either the original file bytes or the add buffer.
+// Neither is ever moved or rewritten, so pieces stay valid until quit.
+typedef struct textPiece
+{
+    const char *start;
+    int len;
+} textPiece;
+
+typedef struct textAddBlock
+{
+    struct textAddBlock *prev;
+    int used;
+    int cap;
+    char data[];
+} textAddBlock;
+
+typedef struct textStore
+{
+    char *orig;
+    size_t origLen;
+    int origMapped;
+    int origCopy;
+    textPiece *lines;
+    textAddBlock *add;
+} textStore;
+
+typedef struct lineScanState
+{
+    const char *lineStart;
+    textPiece *out;
+    int count;
+} lineScanState;
+
+typedef void (*lineScanFn)(lineScanState *st, const char *p, const char *end);
+
+typedef struct lineIndexChunk
+{
+    const char *start;
+    const char *end;
+    const char *lineStart;
+    int first;
+    int count;
+    const char *lastNewline;
+    lineScanFn scan;
+} lineIndexChunk;
+
+// A file of EDITOR_PAGE_THRESHOLD bytes or more is viewed read-only through
+// a window of at most EDITOR_PAGE_ROWS rows; E.rows and E.text.lines hold
+// only the window, which starts at line `first`, byte `firstOffset`. A
+// background scan records in marks[k] where line k * EDITOR_PAGE_STRIDE
+// starts, and counts `lines` until `done`.
+typedef struct pageIndex
+{
+    int active;
+    long long first;
+    size_t firstOffset;
+    int atEnd;
+    size_t *marks;
+    long long numMarks;
+    long long markCap;
+    long long lines;
+    int done;
+    int stop;
+    int changed;
+    pthread_t thread;
+    int indexing;
+} pageIndex;
+
+enum regexOp
+{
+    RE_SET = 0,
+    RE_SPLIT,
+    RE_EPS,
+    RE_MATCH
+};
+
+typedef struct regexState
+{
+    int op;
+    int out;
+    int out1;
+    unsigned char set[32];
+} regexState;
+
+typedef struct regexProg
+{
+    regexState *states;
+    int numStates;
+    int cap;
+    int start;
+    int anchorStart;
+    int anchorEnd;
+    unsigned char first[32];
+    char prefix[REGEX_PREFIX_MAX];
+    int prefixLen;
+    struct regexProg *reverse;
+} regexProg;
+
+typedef struct regexDfaState
+{
+    int *set;
+    int n;
+    int accept;
+    int next[256];
+} regexDfaState;
+
+typedef struct regexDfa
+{
+    const regexProg *prog;
+    int unanchored;
+    regexDfaState **states;
+    int count;
+    int *table;
+    int start;
+    int *stack;
+    int *seen;
+    int gen;
+    int epoch;
+    int *scratch;
+} regexDfa;
+
+enum undoType
+{
+    UNDO_INSERT = 0,
+    UNDO_DELETE,
+    UNDO_SPLIT,
+    UNDO_JOIN,
+    UNDO_ADD_ROW,
+    UNDO_DEL_ROW
+};
+
+// One edit in the undo log, followed in the arena by `len` bytes of text.
+typedef struct undoRecord
+{
+    int type;
+    int group;
+    int row;
+    int col;
+    int len;
+    int prevSize;
+} undoRecord;
+
+// Records live back to back in buf[start, len); those before pos can be
+// undone and those from pos on redone. `last` is the offset of the record
+// that ends at pos, or -1.
+typedef struct undoLog
+{
+    char *buf;
+    size_t start;
+    size_t pos;
+    size_t len;
+    size_t cap;
+    long last;
+    int group;
+    int dropGroup;
+    int typing;
+} undoLog;
+
+// A save in flight: the rows as write slices, taken when it started, and
+// what the writer thread reports back.
+typedef struct editorSaveJob
+{
+    pthread_t thread;
+    int running;
+    int done;
+    char *filename;
+    struct iovec *slices;
+    int count;
+    int cap;
+    long long len;
+    long long journalSize;
+    unsigned int dirty;
+    int result;
+    int err;
+    double ms;
+    double syncMs;
+    double dirMs;
+} editorSaveJob;
+
+// Starts the journal file and names the version of the file its records
+// apply to.
+typedef struct journalHeader
+{
+    char magic[8];
+    long long dev;
+    long long ino;
+    long long size;
+    long long mtimeSec;
+    long long mtimeNsec;
+} journalHeader;
+
+// One edit in the journal, followed by `len` bytes of text. `check` covers
+// the rest of the record and the text, so a torn tail is not replayed.
+typedef struct journalRecord
+{
+    unsigned int check;
+    int type;
+    int row;
+    int col;
+    int len;
+} journalRecord;
+
+// Edits made since the last save, appended to a hidden file beside the one
+// being edited. Records are buffered in buf[0, len) until the keypress that
+// made them is done; `size` is what the file holds.
+typedef struct editJournal
+{
+    int fd;
+    char *path;
+    char *buf;
+    size_t len;
+    size_t cap;
+    long long size;
+    journalHeader base;
+    int haveBase;
+    int failed;
+    int replaying;
+    int unsynced;
+    struct timespec synced;
+} editJournal;
+
+typedef struct regexFrag
+{
+    int start;
+    int end;
+} regexFrag;
+
+typedef struct regexParser
+{
+    const char *p;
+    const char *end;
+    regexProg *prog;
+    int error;
+} regexParser;
+
+typedef struct searchMatch
+{
+    int row;
+    int col;
+    int len;
+} searchMatch;
+
+typedef struct searchIndex
+{
+    searchMatch *matches;
+    int count;
+    int cap;
+    int current;
+    int active;
+    int invalid;
+    char *query;
+    int queryLen;
+} searchIndex;
+
+typedef struct searchJob
+{
+    int from;
+    int to;
+    const char *query;
+    int len;
+    const regexProg *prog;
+    regexDfa dfa;
+    regexDfa dfaAny;
+    regexDfa dfaRev;
+    char *starts;
+    int startsCap;
+    searchIndex out;
+} searchJob;
+
 typedef struct editorRow
 {
-    int idx;
     int size;
-    char *chars;
+    textPiece *pieces;
+    int numPieces;
+    int pieceCap;
     char *render;
     int rsize;
+    int renderCap;
     unsigned char *hl;
-    int hlOpenComment;
+    int renderDirty;
+    int hlStateIn;
+    int hlStateOut;
 } editorRow;
 
+// Byte cx of the gap row starts at render column rx, where the lexer is in
+// hlState (HL_STATE_UNKNOWN if no token starts there).
+typedef struct renderMark
+{
+    int cx;
+    int rx;
+    int hlState;
+} renderMark;
+
+// The row under the cursor while it is being edited: its text lives in buf
+// with the gap at [start, end). `saved` holds the row's pieces from before,
+// of which the first `head` and last `tail` bytes are still unchanged.
+// While its render is current, marks every EDITOR_RENDER_MARK bytes or so
+// let edits patch render and hl locally.
+typedef struct lineGap
+{
+    int row;
+    char *buf;
+    int cap;
+    int start;
+    int end;
+    int head;
+    int tail;
+    editorRow saved;
+    renderMark *marks;
+    int numMarks;
+    int markCap;
+} lineGap;
+
+typedef struct hlKeyword
+{
+    const char *word;
+    int len;
+    unsigned char hl;
+} hlKeyword;
+
+typedef struct hlKeywordTable
+{
+    hlKeyword *slots;
+    unsigned int mask;
+    unsigned long long lengths;
+} hlKeywordTable;
+
 typedef struct editorSyntax
 {
     char *fileType;
@@ -60,8 +452,40 @@ typedef struct editorSyntax
     char *multilineCommentEnd;
 
     int flags;
+    hlKeywordTable *keywordTable;
 } editorSyntax;
 
+typedef struct
+{
+    char *b;
+    int len;
+    int cap;
+} aBuf;
+
+typedef struct screenCell
+{
+    char ch;
+    unsigned char attr;
+} screenCell;
+
+// The frame being drawn and the last frame sent to the terminal.
+typedef struct screenBuf
+{
+    int rows;
+    int cols;
+    screenCell *cells;
+    screenCell *prev;
+    int valid;
+    int rowOff;
+    int colOff;
+    int cursorY;
+    int cursorX;
+    unsigned char pen;
+    char penSeq[3][HL_CLASSES][12];
+    int penLen[3][HL_CLASSES];
+    int frameBytes;
+} screenBuf;
+
 typedef struct editorConfig
 {
     int cx, cy;
@@ -73,26 +497,62 @@ typedef struct editorConfig
     int screenCols;
     int numRows;
     editorRow *rows;
+    int gapStart;
+    int gapLen;
+    int rowsFilled;
+    int rowsShift;
+    lineGap edit;
+    int hlValid;
+    int hlBudget;
+    unsigned int hlGen;
+    pthread_mutex_t lock;
+    pthread_cond_t hlCond;
+    pthread_t hlThread;
+    int hlWorker;
+    int hlStop;
+    int hlRedraw;
+    textStore text;
+    slabAllocator slab;
+    searchIndex search;
+    undoLog undo;
+    editorSaveJob save;
+    editJournal journal;
+    pageIndex page;
+    int searchRegex;
+    mode_t umask;
     char *filename;
     char statusMsg[80];
     time_t statusMsgTime;
     unsigned int dirty;
     struct editorSyntax *syntax;
+    screenBuf screen;
+    aBuf frame;
 } editorConfig;
 
-typedef struct
-{
-    char *b;
-    int len;
-} aBuf;
-
 void die(const char *s);
+int editorWriteAll(int fd, struct iovec *iov, int n);
 void editorSetStatusMessage(const char *fmt, ...);
 void editorUpdateRow(editorRow *row);
-char *editorPrompt(char *prompt, void (*callback)(char *, int));
+editorRow *editorRowAt(int at);
+void lineIndexInitRows(int to);
+void lineGapFlush();
+char *editorPrompt(char *prompt, int allowEmpty, void (*callback)(char *, int));
 void editorRefreshScreen();
 void editorFind();
+void editorReplace();
+void editorUndo();
+void editorRedo();
+void undoPush(int type, int row, int col, const char *text, int len);
+void undoPushTyped(int row, int col, char c);
+void searchIndexFree(searchIndex *idx);
+void journalAppend(int type, int row, int col, const char *text, int len);
+void journalWrite();
+void journalRebase(long long keep);
 void editorUpdateSyntax(editorRow *row);
+void editorUpdateSyntaxFrom(editorRow *row, int at, int state, renderMark *marks, int numMarks,
+                            int resync);
+int is_separator(int c);
 void editorSelectSyntaxHighlight();
+void editorIdle();
 
 #endif
\ No newline at end of file
@@ -0,0 +1,390 @@
+// Benchmarks, run by `make bench`. main.c is compiled in with its main()
+// renamed, as in regress.c, so each bench can time one editor path against
+// the code it replaced.
+#define main editorMain
+#include "../main.c"
+#undef main
+
+#ifndef BENCH_MB
+#define BENCH_MB 256
+#endif
+#ifndef BENCH_FILE_MB
+#define BENCH_FILE_MB 2048
+#endif
+#ifndef BENCH_REPS
+#define BENCH_REPS 3
+#endif
+
+double benchNow()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void benchReport(const char *what, size_t bytes, double seconds)
+{
+    printf("  %-34s %8.1f ms %8.2f GB/s\n", what, seconds * 1e3, bytes / seconds / 1e9);
+}
+
+// Lines of 0..119 printable bytes, about 60 on average, with an occasional
+// CRLF ending.
+char *benchText(size_t len)
+{
+    char *text = malloc(len);
+    if (text == NULL)
+        die("malloc");
+    unsigned int seed = 1;
+    size_t at = 0;
+    while (at < len)
+    {
+        seed = seed * 1103515245 + 12345;
+        size_t n = (seed >> 16) % 120;
+        for (size_t j = 0; j < n && at < len; j++, at++)
+            text[at] = 'a' + at % 26;
+        if (at < len && seed % 16 == 0)
+            text[at++] = '\r';
+        if (at < len)
+            text[at++] = '\n';
+    }
+    return text;
+}
+
+// The parallel newline index against the getline loop editorOpen used to
+// run, on a BENCH_FILE_MB file written out from `text` and mapped the way
+// editorOpen maps it. Filling the rows is timed on its own: editorOpen
+// leaves it to lineIndexInitRows as rows are reached.
+void benchLineIndex(const char *text, size_t textLen)
+{
+    size_t len = (size_t)BENCH_FILE_MB << 20;
+    printf("line index, %zu MB file:\n", len >> 20);
+    char dir[] = "/tmp/editor-bench.XXXXXX";
+    if (mkdtemp(dir) == NULL)
+        die("mkdtemp");
+    char path[64];
+    snprintf(path, sizeof(path), "%s/index.txt", dir);
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1)
+        die("open");
+    for (size_t at = 0; at < len; at += textLen)
+    {
+        struct iovec iov = {(void *)text, len - at < textLen ? len - at : textLen};
+        if (editorWriteAll(fd, &iov, 1) == -1)
+            die("write");
+    }
+
+    double t = benchNow();
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL)
+        die("fopen");
+    char *line = NULL;
+    size_t lineCap = 0;
+    ssize_t lineLen;
+    int lines = 0;
+    while ((lineLen = getline(&line, &lineCap, fp)) != -1)
+    {
+        while (lineLen > 0 && (line[lineLen - 1] == '\n' || line[lineLen - 1] == '\r'))
+            lineLen--;
+        lines++;
+    }
+    free(line);
+    fclose(fp);
+    benchReport("getline loop", len, benchNow() - t);
+
+    if (textMapFile(fd, len) == -1)
+        die("mmap");
+    const char *map = E.text.orig;
+    lineScanFn scans[] = {lineScanScalar,
+#ifdef __SSE2__
+                          lineScanSSE2,
+#endif
+#ifdef LINE_SCAN_X86
+                          __builtin_cpu_supports("avx2") ? lineScanAVX2 : NULL,
+#endif
+                          NULL};
+    const char *names[] = {"newline scan, memchr", "newline scan, SSE2", "newline scan, AVX2"};
+    int count = 0;
+    for (int j = 0; scans[j]; j++)
+    {
+        // The first pass also faults the mapping in; the best of the rest
+        // is the scan alone.
+        double best = 0;
+        for (int rep = 0; rep <= BENCH_REPS; rep++)
+        {
+            lineScanState st = {map, NULL, 0};
+            t = benchNow();
+            scans[j](&st, map, map + len);
+            t = benchNow() - t;
+            best = rep < 2 || t < best ? t : best;
+            count = st.count;
+        }
+        benchReport(names[j], len, best);
+    }
+
+    t = benchNow();
+    lineIndexBuild();
+    benchReport("lineIndexBuild", len, benchNow() - t);
+    t = benchNow();
+    lineIndexInitRows(E.numRows);
+    benchReport("filling every row", len, benchNow() - t);
+    printf("  %-34s %8d rows\n", "", E.numRows);
+    if (count != lines && count + 1 != lines)
+        printf("  line counts differ: %d vs %d\n", count, lines);
+
+    free(E.text.lines);
+    free(E.rows);
+    E.text.lines = NULL;
+    E.rows = NULL;
+    E.numRows = E.gapStart = E.gapLen = 0;
+    E.rowsFilled = E.rowsShift = 0;
+    textFree();
+    close(fd);
+    unlink(path);
+    rmdir(dir);
+}
+
+// Frame building into E.frame on a fixed 200x60 terminal with main.c open.
+// The frame is written to /dev/null so only the building is timed.
+void benchFrames()
+{
+    const int frames = 2000;
+    printf("frame build, 200x60, main.c:\n");
+    editorOpen("main.c");
+    screenInit(60, 200);
+    E.screenRows = 58;
+    E.screenCols = 200;
+
+    int out = dup(STDOUT_FILENO);
+    int null = open("/dev/null", O_WRONLY);
+    if (out == -1 || null == -1)
+        die("open");
+    fflush(stdout);
+    dup2(null, STDOUT_FILENO);
+
+    editorRefreshScreen();
+    double t = benchNow();
+    for (int j = 0; j < frames; j++)
+    {
+        abFree(&E.frame);
+        E.screen.valid = 0;
+        editorRefreshScreen();
+    }
+    double fresh = benchNow() - t;
+    t = benchNow();
+    for (int j = 0; j < frames; j++)
+    {
+        E.screen.valid = 0;
+        editorRefreshScreen();
+    }
+    double reused = benchNow() - t;
+    int bytes = E.screen.frameBytes;
+    t = benchNow();
+    for (int j = 0; j < frames; j++)
+        editorRefreshScreen();
+    double unchanged = benchNow() - t;
+
+    dup2(out, STDOUT_FILENO);
+    close(out);
+    close(null);
+    printf("  %-34s %8.1f us\n", "full repaint, fresh buffer", fresh / frames * 1e6);
+    printf("  %-34s %8.1f us (%d bytes)\n", "full repaint, reused buffer", reused / frames * 1e6, bytes);
+    printf("  %-34s %8.1f us (%d bytes)\n", "unchanged frame, reused buffer", unchanged / frames * 1e6,
+           E.screen.frameBytes);
+}
+
+// The keyword loop editorUpdateSyntax ran before the compiled table: every
+// keyword compared in turn at each position that follows a separator.
+int benchKeywordScan(char **keywords, const char *s)
+{
+    for (int j = 0; keywords[j]; j++)
+    {
+        int klen = strlen(keywords[j]);
+        int kw2 = keywords[j][klen - 1] == '|';
+        if (kw2)
+            klen--;
+        if (!strncmp(s, keywords[j], klen) && is_separator(s[klen]))
+            return kw2 ? HL_KEYWORD2 : HL_KEYWORD1;
+    }
+    return HL_NORMAL;
+}
+
+// Keyword matching and whole-row highlighting over a C corpus made of
+// copies of main.c.
+void benchKeywords(size_t len)
+{
+    printf("keywords, %zu MB of main.c copies:\n", len >> 20);
+    FILE *fp = fopen("main.c", "r");
+    if (fp == NULL)
+        die("fopen");
+    char *corpus = malloc(len + 1);
+    if (corpus == NULL)
+        die("malloc");
+    size_t got = fread(corpus, 1, len, fp);
+    fclose(fp);
+    for (size_t at = got; at < len; at += got)
+        memcpy(corpus + at, corpus, len - at < got ? len - at : got);
+    corpus[len] = '\0';
+
+    editorSyntax *syntax = &HLDB[0];
+    hlCompileKeywords(syntax);
+    int linear = 0, hashed = 0;
+    double t = benchNow();
+    for (size_t i = 1; i < len; i++)
+        if (is_separator(corpus[i - 1]) && benchKeywordScan(syntax->keywords, corpus + i))
+            linear++;
+    benchReport("keyword list scan", len, benchNow() - t);
+    t = benchNow();
+    for (size_t i = 1; i < len; i++)
+    {
+        if (!is_separator(corpus[i - 1]))
+            continue;
+        size_t end = i;
+        while (!is_separator(corpus[end]))
+            end++;
+        if (end - i < HL_KEYWORD_MAX_LEN && hlKeywordLookup(syntax->keywordTable, corpus + i, end - i))
+            hashed++;
+    }
+    benchReport("hlKeywordLookup", len, benchNow() - t);
+    if (linear != hashed)
+        printf("  keyword counts differ: %d vs %d\n", linear, hashed);
+
+    char dir[] = "/tmp/editor-bench.XXXXXX";
+    if (mkdtemp(dir) == NULL)
+        die("mkdtemp");
+    char path[64];
+    snprintf(path, sizeof(path), "%s/corpus.c", dir);
+    fp = fopen(path, "w");
+    if (fp == NULL)
+        die("fopen");
+    fwrite(corpus, 1, len, fp);
+    fclose(fp);
+    free(corpus);
+
+    editorOpen(path);
+    t = benchNow();
+    int state = 0;
+    for (int at = 0; at < E.numRows; at++)
+    {
+        editorRow *row = editorRowAt(at);
+        row->hlStateIn = state;
+        editorRenderRow(row);
+        editorUpdateSyntax(row);
+        state = row->hlStateOut;
+        editorRowReleaseRender(row);
+    }
+    benchReport("render and highlight every row", len, benchNow() - t);
+    unlink(path);
+    rmdir(dir);
+}
+
+void benchCheckCount(int found, int planted)
+{
+    if (found != planted)
+        printf("  found %d of %d planted matches\n", found, planted);
+}
+
+// textSearch against the per-row strstr loop find ran before, for a needle
+// planted about every 64 KB of the generated text.
+void benchSearch(const char *orig, size_t len)
+{
+    const char *needle = "needle";
+    size_t m = strlen(needle);
+    printf("search, %zu MB:\n", len >> 20);
+    char *text = malloc(len);
+    char *rows = malloc(len + 1);
+    if (text == NULL || rows == NULL)
+        die("malloc");
+    memcpy(text, orig, len);
+    int planted = 0;
+    for (size_t at = 4096; at + m <= len; at += 65536)
+        if (memchr(text + at, '\n', m) == NULL && memchr(text + at, '\r', m) == NULL)
+        {
+            memcpy(text + at, needle, m);
+            planted++;
+        }
+    for (size_t j = 0; j < len; j++)
+        rows[j] = text[j] == '\n' ? '\0' : text[j];
+    rows[len] = '\0';
+    E.text.orig = text;
+    E.text.origLen = len;
+    lineIndexBuild();
+
+    // Each pass is run BENCH_REPS times and the fastest is reported, since
+    // the per-row passes are close and the machine is noisy.
+    int found = 0;
+    double best = 0;
+    for (int rep = 0; rep < BENCH_REPS; rep++)
+    {
+        found = 0;
+        double t = benchNow();
+        for (int j = 0; j < E.numRows; j++)
+        {
+            const char *row = rows + (E.text.lines[j].start - text);
+            for (const char *p = row; (p = strstr(p, needle)) != NULL; p++)
+                found++;
+        }
+        t = benchNow() - t;
+        best = rep == 0 || t < best ? t : best;
+    }
+    benchReport("strstr per row", len, best);
+    benchCheckCount(found, planted);
+
+    for (int rep = 0; rep < BENCH_REPS; rep++)
+    {
+        found = 0;
+        double t = benchNow();
+        for (int j = 0; j < E.numRows; j++)
+        {
+            const char *row = E.text.lines[j].start;
+            size_t n = E.text.lines[j].len;
+            for (const char *p = row; (p = textSearch(p, row + n - p, needle, m)) != NULL; p++)
+                found++;
+        }
+        t = benchNow() - t;
+        best = rep == 0 || t < best ? t : best;
+    }
+    benchReport("textSearch per row", len, best);
+    benchCheckCount(found, planted);
+
+    for (int rep = 0; rep < BENCH_REPS; rep++)
+    {
+        found = 0;
+        double t = benchNow();
+        for (const char *p = text; (p = textSearch(p, text + len - p, needle, m)) != NULL; p++)
+            found++;
+        t = benchNow() - t;
+        best = rep == 0 || t < best ? t : best;
+    }
+    benchReport("textSearch over the whole text", len, best);
+    benchCheckCount(found, planted);
+
+    free(E.text.lines);
+    free(E.rows);
+    E.text.lines = NULL;
+    E.rows = NULL;
+    E.numRows = E.gapStart = E.gapLen = 0;
+    E.rowsFilled = E.rowsShift = 0;
+    E.text.orig = NULL;
+    E.text.origLen = 0;
+    free(rows);
+    free(text);
+}
+
+int main()
+{
+    // The fields initEditorConfig would set that have no zero default.
+    E.edit.row = -1;
+    E.undo.last = -1;
+    E.undo.dropGroup = -1;
+    E.search.current = -1;
+    E.journal.fd = -1;
+
+    size_t len = (size_t)BENCH_MB << 20;
+    char *text = benchText(len);
+    benchLineIndex(text, len);
+    benchSearch(text, len);
+    free(text);
+    benchFrames();
+    benchKeywords(len / 8);
+    return EXIT_SUCCESS;
+}
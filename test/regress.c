@@ -0,0 +1,557 @@
+// Regression checks, run by `make test`. main.c is compiled in with its
+// main() renamed so the checks can drive the editor state directly.
+#define main editorMain
+#include "../main.c"
+#undef main
+
+int failures = 0;
+
+void check(int ok, const char *what)
+{
+    if (!ok)
+    {
+        fprintf(stderr, "FAIL: %s\n", what);
+        failures++;
+    }
+}
+
+int rowIs(int at, const char *s)
+{
+    char buf[64];
+    editorRow *row = editorRowAt(at);
+    if (row->size != (int)strlen(s) || row->size > (int)sizeof(buf))
+        return 0;
+    textRowCopy(row, buf);
+    return memcmp(buf, s, row->size) == 0;
+}
+
+// Opens `path` the way a fresh editor would.
+void reopen(const char *path)
+{
+    E.edit.row = -1;
+    E.undo.start = E.undo.pos = E.undo.len = 0;
+    E.undo.last = -1;
+    E.undo.dropGroup = -1;
+    E.search.current = -1;
+    E.journal.fd = -1;
+    E.journal.len = 0;
+    editorOpen((char *)path);
+}
+
+void setUp(const char *path, const char *text)
+{
+    FILE *f = fopen(path, "w");
+    fputs(text, f);
+    fclose(f);
+    reopen(path);
+}
+
+// A borrowed line emptied through the gap buffer must not keep spanning its
+// old bytes in the line index.
+void testEmptiedLine(const char *path)
+{
+    setUp(path, "abc\nxyz\nabc\n");
+    E.cy = 0;
+    E.cx = 3;
+    for (int j = 0; j < 3; j++)
+    {
+        E.undo.group++;
+        editorDelChar();
+    }
+    E.cy = 1;
+    lineGapFlush();
+
+    editorSearchAll("abc");
+    check(E.search.count == 1, "search finds the deleted text of an emptied line");
+    searchIndexFree(&E.search);
+
+    int rows;
+    E.undo.group++;
+    editorReplaceAll("abc", "Q", &rows);
+    check(rowIs(0, "") && rowIs(1, "xyz") && rowIs(2, "Q"),
+          "replace-all writes into an emptied line");
+}
+
+// Rows that still cover their line-index entries, blank lines included,
+// are searched as one span; edited ones on their own.
+void testSpanSearch(const char *path)
+{
+    setUp(path, "abc\n\nabc\nab\n");
+    E.cy = 3;
+    E.cx = 2;
+    E.undo.group++;
+    editorInsertChar('c');
+    E.cy = 0;
+    lineGapFlush();
+
+    editorSearchAll("abc");
+    check(E.search.count == 3, "span search over blank and edited rows");
+    searchIndexFree(&E.search);
+}
+
+// Spans grow from EDITOR_SEARCH_SPAN_MIN rows up to EDITOR_SEARCH_SPAN_ROWS;
+// no row is skipped or searched twice across their ends.
+void testSpanGrowth(const char *path)
+{
+    char text[4 * 500 + 1];
+    for (int j = 0; j < 500; j++)
+        memcpy(text + 4 * j, "abc\n", 4);
+    text[4 * 500] = '\0';
+    setUp(path, text);
+    editorSearchAll("abc");
+    check(E.search.count == 500, "span search across growing spans");
+    searchIndexFree(&E.search);
+}
+
+// An empty replacement deletes every match, literal or regex.
+void testReplaceWithNothing(const char *path)
+{
+    setUp(path, "a-b-c\nxy--z\n");
+    int rows;
+    E.undo.group++;
+    check(editorReplaceAll("-", "", &rows) == 4 && rows == 2, "replace-all with nothing counts");
+    check(rowIs(0, "abc") && rowIs(1, "xyz"), "replace-all with nothing deletes the matches");
+    E.undo.group++;
+    editorUndo();
+    check(rowIs(0, "a-b-c") && rowIs(1, "xy--z"), "undo restores deleted matches");
+}
+
+// Saving in place moves the rows' bytes off the file once; the rows keep
+// reading the same text and later saves do not copy it again.
+void testSaveInPlace(const char *path)
+{
+    setUp(path, "abc\nxyz\n");
+    char *orig = E.text.orig;
+    editorSaveSnapshot(&E.save);
+    E.save.filename = (char *)path;
+    pthread_mutex_unlock(&E.lock);
+    int r = editorSaveInPlace(&E.save);
+    pthread_mutex_lock(&E.lock);
+    E.save.filename = NULL;
+    check(r == 0 && E.text.orig == orig && !E.text.origMapped && E.text.origCopy,
+          "in-place save detaches the mapping once");
+    check(rowIs(0, "abc") && rowIs(1, "xyz"), "rows survive an in-place save");
+}
+
+// The match state is added last; patterns whose states fill the array up to
+// a growth boundary right before it must still match.
+void testRegexGrowth()
+{
+    char pattern[128], text[128];
+    int failed = 0;
+    for (int n = 1; n < 100 && !failed; n++)
+    {
+        pattern[0] = '(';
+        memset(pattern + 1, 'a', n);
+        pattern[n + 1] = ')';
+        memset(text, 'b', 4);
+        memset(text + 4, 'a', n);
+        regexProg *prog = regexCompile(pattern, n + 2);
+        regexDfa dfa;
+        regexDfaInit(&dfa, prog, 1);
+        failed = regexMatchLast(&dfa, text, n + 4) < 0 || regexMatchLast(&dfa, text, n + 3) >= 0;
+        regexDfaFree(&dfa);
+        regexFree(prog);
+    }
+    check(!failed, "regex with states across a growth boundary matches");
+}
+
+// Multi-line comment state reaches every row, blank ones included, whether
+// the worker or the idle-time walk does the highlighting.
+void testHighlightPass(const char *path)
+{
+    setUp(path, "/* a\n\nb */\nint x;\n");
+    editorStartHlWorker();
+    while (E.hlValid < E.numRows)
+    {
+        if (E.hlWorker)
+        {
+            pthread_cond_signal(&E.hlCond);
+            pthread_mutex_unlock(&E.lock);
+            sched_yield();
+            pthread_mutex_lock(&E.lock);
+        }
+        else
+            editorHighlightStep(EDITOR_HL_IDLE_BATCH);
+    }
+    check(E.hlWorker == EDITOR_HL_WORKER, "worker runs only when enabled");
+    editorStopHlWorker();
+    E.hlStop = 0;
+    check((editorRowAt(0)->hlStateOut & HL_STATE_ML_COMMENT) &&
+              (editorRowAt(1)->hlStateOut & HL_STATE_ML_COMMENT) &&
+              !(editorRowAt(2)->hlStateOut & HL_STATE_ML_COMMENT) &&
+              !(editorRowAt(3)->hlStateOut & HL_STATE_ML_COMMENT),
+          "comment state flows across a blank row");
+}
+
+// Typing on the empty row past the end adds that row and the first
+// character together; the characters after it undo on their own, and the
+// row goes with the first one.
+void testUndoTypingPastEnd(const char *path)
+{
+    setUp(path, "abc\n");
+    E.cy = 1;
+    E.cx = 0;
+    const char *typed = "xyz";
+    for (int j = 0; typed[j]; j++)
+    {
+        E.undo.group++;
+        editorInsertChar(typed[j]);
+    }
+    E.undo.group++;
+    editorUndo();
+    check(E.numRows == 2 && rowIs(1, "x"), "undo removes the typing after the first character");
+    E.undo.group++;
+    editorUndo();
+    check(E.numRows == 1 && rowIs(0, "abc"), "undo removes the added row with its character");
+}
+
+// Closing the search prompt must not write the saved colours over a row
+// whose highlighting the worker replaced while the prompt was open.
+void testFindRestore(const char *path)
+{
+    setUp(path, "abc abc\nxyz\n");
+    editorFindCallback("abc", 'c');
+    editorRow *row = editorRowAt(0);
+    check(row->hl && row->hl[0] == HL_MATCH, "find marks the current match");
+    unsigned char *marked = row->hl;
+    unsigned char *published = malloc(row->rsize);
+    memset(published, HL_NUMBER, row->rsize);
+    row->hl = published;
+    editorFindCallback("abc", '\r');
+    check(published[0] == HL_NUMBER && row->hl == published,
+          "closing find keeps highlighting published meanwhile");
+    row->hl = marked;
+    free(published);
+}
+
+// Edits to rows opened from the file build pieces of their own and leave
+// the shared line index as it was.
+void testPieceTable(const char *path)
+{
+    setUp(path, "abcdef\nxyz\nqrs\n");
+    textRowInsert(editorRowAt(0), 3, "XY", 2);
+    textRowDelete(editorRowAt(1), 1, 1);
+    textRowInsert(editorRowAt(2), 3, "!", 1);
+    check(rowIs(0, "abcXYdef") && rowIs(1, "xz") && rowIs(2, "qrs!"), "piece table edits");
+    check(E.text.lines[0].len == 6 && E.text.lines[1].len == 3 && E.text.lines[2].len == 3,
+          "piece table edits leave the line index alone");
+    textRowTruncate(editorRowAt(0), 4);
+    textRowDelete(editorRowAt(0), 0, 1);
+    check(rowIs(0, "bcX") && E.text.lines[0].len == 6, "truncate and delete at the front");
+}
+
+// Typing on a row goes through the gap buffer, growing it when full; the
+// row reads as its two sides meanwhile, and flushing it keeps the untouched
+// head and tail on the file's bytes.
+void testGapBuffer(const char *path)
+{
+    setUp(path, "hello world\nnext\n");
+    E.cy = 0;
+    E.cx = 5;
+    E.undo.group++;
+    for (const char *s = ", big"; *s; s++)
+        editorInsertChar(*s);
+    E.cx = 2;
+    editorDelChar();
+    editorRow *row = editorRowAt(0);
+    check(E.edit.row == 0 && row->numPieces <= 2 && rowIs(0, "hllo, big world"),
+          "typing edits the row through the gap buffer");
+
+    E.cx = 9;
+    for (int j = 0; j < 3 * EDITOR_LINE_GAP; j++)
+        editorInsertChar('a' + j % 26);
+    check(row->size == 15 + 3 * EDITOR_LINE_GAP && lineGapByte(E.cx - 1) == 'a' + (3 * EDITOR_LINE_GAP - 1) % 26 &&
+              lineGapByte(E.cx) == ' ',
+          "the gap buffer grows past its first gap");
+    for (int j = 0; j < 3 * EDITOR_LINE_GAP; j++)
+        editorDelChar();
+    check(rowIs(0, "hllo, big world"), "deleting backwards through the gap buffer");
+
+    E.cy = 1;
+    lineGapFlush();
+    row = editorRowAt(0);
+    check(E.edit.row == -1 && rowIs(0, "hllo, big world") && rowIs(1, "next"), "flushing the gap buffer");
+    check(row->pieces[0].start == E.text.orig && row->pieces[row->numPieces - 1].start == E.text.orig + 5,
+          "flushing keeps the untouched head and tail on the file");
+    E.undo.group++;
+    editorUndo();
+    check(rowIs(0, "hello world"), "undo after gap buffer edits");
+}
+
+// Ends the session the way a crash would: buffered records reach the
+// journal, which is left behind.
+void journalAbandon()
+{
+    journalWrite();
+    close(E.journal.fd);
+}
+
+// Reopening a file replays the journal a dead session left next to it, up
+// to a torn record, and never onto a file that changed since.
+void testJournal(const char *path, const char *journal)
+{
+    setUp(path, "abc\nxyz\n");
+    E.cy = 0;
+    E.cx = 3;
+    E.undo.group++;
+    editorInsertChar('!');
+    E.cy = 1;
+    E.cx = 0;
+    E.undo.group++;
+    editorInsertNewline();
+    E.cx = 3;
+    E.undo.group++;
+    editorInsertChar('?');
+    journalAbandon();
+
+    reopen(path);
+    check(E.numRows == 3 && rowIs(0, "abc!") && rowIs(1, "") && rowIs(2, "xyz?") && E.dirty,
+          "reopening replays the journal");
+    journalAbandon();
+
+    struct stat st;
+    if (stat(journal, &st) == -1 || truncate(journal, st.st_size - 1) == -1)
+        die("truncate");
+    reopen(path);
+    check(E.numRows == 3 && rowIs(0, "abc!") && rowIs(2, "xyz"), "replay stops at a torn record");
+    journalAbandon();
+
+    if (stat(path, &st) == -1)
+        die("stat");
+    struct timespec times[2] = {{0, UTIME_OMIT}, {st.st_mtim.tv_sec + 1, 0}};
+    utimensat(AT_FDCWD, path, times, 0);
+    reopen(path);
+    check(E.numRows == 2 && rowIs(0, "abc") && rowIs(1, "xyz"), "a journal is not replayed onto a changed file");
+    unlink(journal);
+}
+
+// Inserts and deletes scattered across the file keep every row in order and
+// its index derived from its slot, checked against a plain array of lines.
+void testGapArray(const char *path)
+{
+    setUp(path, "0\n1\n2\n3\n4\n5\n6\n7\n");
+    static char added[200][8];
+    char model[64][8];
+    int n = 8;
+    for (int j = 0; j < n; j++)
+        sprintf(model[j], "%d", j);
+    unsigned int seed = 7;
+    for (int step = 0; step < 200; step++)
+    {
+        seed = seed * 1103515245 + 12345;
+        int at = (seed >> 16) % (n + 1);
+        if (n < 4 || (n < 60 && seed % 3))
+        {
+            sprintf(added[step], "s%d", step);
+            textPiece piece = {added[step], strlen(added[step])};
+            editorInsertRow(at, &piece, 1);
+            memmove(model[at + 1], model[at], sizeof(model[0]) * (n - at));
+            memcpy(model[at], added[step], sizeof(model[0]));
+            n++;
+        }
+        else if (at < n)
+        {
+            editorDeleteRow(at);
+            memmove(model[at], model[at + 1], sizeof(model[0]) * (n - at - 1));
+            n--;
+        }
+    }
+    int same = E.numRows == n;
+    for (int j = 0; j < n && same; j++)
+        same = rowIs(j, model[j]) && editorRowIndex(editorRowAt(j)) == j;
+    check(same, "gap array rows match a plain array after scattered edits");
+}
+
+// textSearch agrees with a plain scan for every length of haystack, matches
+// at the very end included, on text that ends right before an unmapped page.
+void testTextSearch()
+{
+    long page = sysconf(_SC_PAGESIZE);
+    char *map = mmap(NULL, 2 * page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED || mprotect(map + page, page, PROT_NONE) == -1)
+        die("mmap");
+    const char *needle = "abcab";
+    int failed = 0;
+    for (int n = 0; n <= 100 && !failed; n++)
+    {
+        char *hay = map + page - n;
+        for (int j = 0; j < n; j++)
+            hay[j] = "abc"[(j * 7 + n) % 3];
+        for (int m = 1; m <= 5 && !failed; m++)
+        {
+            const char *want = NULL;
+            for (int j = 0; j + m <= n && want == NULL; j++)
+                if (!memcmp(hay + j, needle, m))
+                    want = hay + j;
+            failed = textSearch(hay, n, needle, m) != want;
+        }
+        if (n >= 5 && !failed)
+        {
+            memcpy(hay + n - 5, needle, 5);
+            const char *hit = textSearch(hay, n, needle, 5);
+            failed = hit == NULL || hit > hay + n - 5;
+        }
+    }
+    munmap(map, 2 * page);
+    check(!failed, "textSearch up to the end of a page");
+}
+
+int matchIs(int j, int row, int col, int len)
+{
+    return j < E.search.count && E.search.matches[j].row == row &&
+           E.search.matches[j].col == col && E.search.matches[j].len == len;
+}
+
+// Regex matches are the leftmost-longest ones, whether or not the pattern
+// has a literal prefix, and a prefix that hits at every column of a long row
+// with no match does not start a scan from each of them.
+void testRegexSearch(const char *path)
+{
+    E.searchRegex = 1;
+    setUp(path, "xaaz aaz\nab az\nabc\n");
+    editorSearchAll("a+z");
+    check(E.search.count == 3 && matchIs(0, 0, 1, 3) && matchIs(1, 0, 5, 3) && matchIs(2, 1, 3, 2),
+          "regex with a prefix finds every match");
+    searchIndexFree(&E.search);
+    editorSearchAll("[ab]+z$");
+    check(E.search.count == 2 && matchIs(0, 0, 5, 3) && matchIs(1, 1, 3, 2),
+          "regex anchored at the end");
+    searchIndexFree(&E.search);
+    editorSearchAll("c|abc|b");
+    check(E.search.count == 2 && matchIs(0, 1, 1, 1) && matchIs(1, 2, 0, 3),
+          "regex takes the leftmost longest match");
+    searchIndexFree(&E.search);
+
+    static char text[100002];
+    memset(text, 'a', 100000);
+    text[100000] = '\n';
+    setUp(path, text);
+    clock_t start = clock();
+    editorSearchAll("a+z");
+    editorSearchAll("a*z");
+    check(E.search.count == 0 && clock() - start < CLOCKS_PER_SEC,
+          "regex search over a long row without a match stays linear");
+    searchIndexFree(&E.search);
+    E.searchRegex = 0;
+}
+
+// Rows are set up from the line index only when reached; rows inserted and
+// deleted before that must not shift which line a later row shows.
+void testLazyRows(const char *path)
+{
+    int lines = EDITOR_FILL_ROWS * 3;
+    char *text = malloc(lines * 8);
+    int len = 0;
+    for (int j = 0; j < lines; j++)
+        len += sprintf(text + len, "%d\n", j);
+    setUp(path, text);
+    check(E.rowsFilled == 0, "opening a file leaves its rows to be filled");
+    editorSearchAll("1234");
+    check(E.search.count == 2 && E.rowsFilled == E.numRows, "search fills every row before its jobs start");
+    searchIndexFree(&E.search);
+
+    setUp(path, text);
+    free(text);
+
+    textPiece piece = {"new", 3};
+    char at[16];
+    editorInsertRow(EDITOR_FILL_ROWS + 5, &piece, 1);
+    editorDeleteRow(0);
+    editorDeleteRow(1);
+    sprintf(at, "%d", EDITOR_FILL_ROWS * 2);
+    check(rowIs(EDITOR_FILL_ROWS + 3, "new") && rowIs(0, "1") && rowIs(1, "3") &&
+              rowIs(EDITOR_FILL_ROWS * 2 - 1, at) && E.numRows == lines - 1,
+          "rows filled after an insert and deletes show their own lines");
+}
+
+// Paging mode shows a window of rows, indexes the file in the background,
+// and can jump to any line from the marks it recorded, in either direction.
+void testPaging(const char *path)
+{
+    int lines = 3 * EDITOR_PAGE_STRIDE + 1000;
+    FILE *f = fopen(path, "w");
+    for (int j = 0; j < lines; j++)
+        fprintf(f, j + 1 < lines ? "%d\n" : "%d", j);
+    fclose(f);
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1 || textMapFile(fd, st.st_size) == -1)
+        die("open");
+    close(fd);
+    E.edit.row = -1;
+    pageOpen();
+    pageIndex *pg = &E.page;
+    check(E.numRows == EDITOR_PAGE_ROWS && rowIs(0, "0") && editorReadOnly(), "paging opens a read-only window");
+
+    pthread_mutex_unlock(&E.lock);
+    pthread_join(pg->thread, NULL);
+    pthread_mutex_lock(&E.lock);
+    pg->indexing = 0;
+    int marked = pg->numMarks == 4;
+    for (int k = 0; k < pg->numMarks && marked; k++)
+    {
+        char want[16];
+        int n = sprintf(want, "%d\n", k * EDITOR_PAGE_STRIDE);
+        marked = memcmp(E.text.orig + pg->marks[k], want, n) == 0;
+    }
+    check(pg->done && pg->lines == lines && marked, "the background index counts lines and marks strides");
+
+    char want[16];
+    long long targets[] = {2 * EDITOR_PAGE_STRIDE + 77, 2 * EDITOR_PAGE_STRIDE - 3000, EDITOR_PAGE_STRIDE + 5, lines - 1};
+    int found = 1;
+    for (int j = 0; j < 4 && found; j++)
+    {
+        pageGoto(targets[j]);
+        sprintf(want, "%lld", targets[j]);
+        found = E.numRows <= EDITOR_PAGE_ROWS && pg->first + E.cy == targets[j] && rowIs(E.cy, want);
+    }
+    check(found, "going to a line loads the window around it");
+    pageGoto(lines + 10);
+    sprintf(want, "%d", lines - 1);
+    check(pg->atEnd && rowIs(E.cy, want), "going past the end stops at the last line");
+
+    pageClose();
+    pg->active = 0;
+}
+
+int main()
+{
+    char dir[] = "/tmp/editor-test.XXXXXX";
+    if (mkdtemp(dir) == NULL)
+        die("mkdtemp");
+    char path[64], journal[64], source[64], sourceJournal[64];
+    snprintf(path, sizeof(path), "%s/a.txt", dir);
+    snprintf(journal, sizeof(journal), "%s/.a.txt.journal", dir);
+    snprintf(source, sizeof(source), "%s/a.c", dir);
+    snprintf(sourceJournal, sizeof(sourceJournal), "%s/.a.c.journal", dir);
+    pthread_mutex_lock(&E.lock);
+
+    testEmptiedLine(path);
+    testSpanSearch(path);
+    testSpanGrowth(path);
+    testReplaceWithNothing(path);
+    testSaveInPlace(path);
+    testRegexGrowth();
+    testRegexSearch(path);
+    testUndoTypingPastEnd(path);
+    testFindRestore(path);
+    testPieceTable(path);
+    testGapBuffer(path);
+    testGapArray(path);
+    testJournal(path, journal);
+    testTextSearch();
+    testLazyRows(path);
+    testHighlightPass(source);
+    testPaging(path);
+
+    journalClose();
+    unlink(path);
+    unlink(journal);
+    unlink(source);
+    unlink(sourceJournal);
+    rmdir(dir);
+    if (failures == 0)
+        printf("all checks passed\n");
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}